@@ -0,0 +1,172 @@
+#include <linux/fs.h>
+#include <linux/crc32c.h>
+#include <linux/mm.h>
+
+#include "ksrfs.h"
+
+/*
+ * Content based block deduplication.
+ *
+ * Blocks written up to their end are hashed with crc32c (which uses the
+ * crc32 instruction through the crypto layer where available) and indexed
+ * in the dedup table of their group. A block identical to an indexed one
+ * is dropped and the block map entry is redirected to the indexed block.
+ * Shared blocks are copied on the next write through srfs_cow_block.
+ */
+
+extern struct srfs_block_info *srfs_get_free_block(struct super_block *sb, struct inode *inode);
+
+extern bool __srfs_put_block(struct srfs_group_info *gi, struct srfs_block_info *bi);
+
+extern int srfs_reserve_blocks(struct super_block *sb, uint64_t nr);
+
+extern void srfs_release_blocks(struct super_block *sb, uint64_t nr);
+
+/*
+ * The block at seq of the inode was replaced, drop the page of a read only
+ * mapping still showing the old one, map_sem must be held exclusive
+ */
+static void srfs_unmap_block(struct inode *inode, uint64_t seq)
+{
+	struct address_space *mapping = inode->i_mapping;
+
+	if (mapping_mapped(mapping)) {
+		unmap_mapping_range(mapping, round_down((loff_t)seq*SRFS_BLOCK_SIZE, PAGE_SIZE),
+					PAGE_SIZE, 1);
+	}
+}
+
+/*
+ * Share the fully written seq-th block of the inode with an identical one.
+ * Dedup is only an optimization, a nonblocking caller skips it rather than
+ * wait for map_sem.
+ */
+void srfs_dedup_block(struct super_block *sb, struct inode *inode,
+							uint64_t seq, bool nowait)
+{
+	struct srfs_inode_info *si;
+	struct srfs_group_info *gi;
+	struct srfs_block_info *bi, *dup;
+	uint32_t hash;
+	bool freed;
+
+	si = SRFS_INODE(inode);
+	bi = si->blocks[seq];
+	gi = GET_GROUP_BY_BLOCK_ID(sb, bi->id);
+
+	hash = crc32c(~0, bi->addr, gi->blk_size);
+
+	/* No reader looks bi up while it is swapped out, pinned copies keep it */
+	if (srfs_map_lock(si, nowait)) {
+		return;
+	}
+	spin_lock(&gi->lock);
+	if (!hlist_unhashed(&bi->hnode)) {
+		/* Already indexed, nothing changed since */
+		spin_unlock(&gi->lock);
+		up_write(&si->map_sem);
+		return;
+	}
+
+	hash_for_each_possible(gi->dedup, dup, hnode, hash) {
+		if (dup->hash == hash && !memcmp(dup->addr, bi->addr, gi->blk_size)) {
+			dup->refcnt++;
+			si->blocks[seq] = dup;
+			freed = __srfs_put_block(gi, bi);
+			spin_unlock(&gi->lock);
+			srfs_unmap_block(inode, seq);
+			up_write(&si->map_sem);
+			if (freed) {
+				srfs_release_blocks(sb, 1);
+			}
+			return;
+		}
+	}
+
+	bi->hash = hash;
+	hash_add(gi->dedup, &bi->hnode, hash);
+	spin_unlock(&gi->lock);
+	up_write(&si->map_sem);
+}
+
+/*
+ * Return the seq-th block of the inode ready to be modified.
+ * A block referenced by other map entries is copied first, an exclusive one
+ * is only removed from the dedup table since its content is about to change.
+ * Returns an ERR_PTR on failure, -EAGAIN if a nonblocking caller would have
+ * to wait for map_sem to swap in the copy.
+ */
+struct srfs_block_info *srfs_cow_block(struct super_block *sb,
+								struct inode *inode,
+								uint64_t seq,
+								bool nowait)
+{
+	struct srfs_inode_info *si;
+	struct srfs_group_info *gi;
+	struct srfs_block_info *bi, *nbi;
+	bool reserved = false, freed;
+	int ret;
+
+	si = SRFS_INODE(inode);
+	if (seq >= si->blk_cnt) {
+		printk(KERN_ERR "try to cow block %llu, but allocated only %llu\n", seq, si->blk_cnt);
+		return ERR_PTR(-EINVAL);
+	}
+
+	bi = si->blocks[seq];
+	gi = GET_GROUP_BY_BLOCK_ID(sb, bi->id);
+
+again:
+	spin_lock(&gi->lock);
+	if (bi->refcnt == 1) {
+		if (!hlist_unhashed(&bi->hnode)) {
+			hash_del(&bi->hnode);
+		}
+		spin_unlock(&gi->lock);
+		if (reserved) {
+			up_write(&si->map_sem);
+			srfs_release_blocks(sb, 1);
+		}
+		return bi;
+	}
+	spin_unlock(&gi->lock);
+
+	if (!reserved) {
+		/* The copy is a new block and counts against the size limit */
+		if (srfs_reserve_blocks(sb, 1)) {
+			return ERR_PTR(-ENOSPC);
+		}
+		ret = srfs_map_lock(si, nowait);
+		if (ret) {
+			srfs_release_blocks(sb, 1);
+			return ERR_PTR(ret);
+		}
+		reserved = true;
+		goto again;
+	}
+
+	/* Like any new block of the inode, from its group first, then the others */
+	nbi = srfs_get_free_block(sb, inode);
+	if (!nbi) {
+		up_write(&si->map_sem);
+		srfs_release_blocks(sb, 1);
+		return ERR_PTR(-ENOSPC);
+	}
+
+	/* A shared block isn't modified in place, it can be copied unlocked */
+	memcpy(nbi->addr, bi->addr, gi->blk_size);
+
+	/* The other references may have gone meanwhile, making this the last one */
+	spin_lock(&gi->lock);
+	freed = __srfs_put_block(gi, bi);
+	si->blocks[seq] = nbi;
+	spin_unlock(&gi->lock);
+	srfs_unmap_block(inode, seq);
+	up_write(&si->map_sem);
+
+	if (freed) {
+		srfs_release_blocks(sb, 1);
+	}
+
+	return nbi;
+}
@@ -1,5 +1,8 @@
 #include <linux/fs.h>
-#include <asm/uaccess.h>
+#include <linux/uaccess.h>
+#include <linux/prefetch.h>
+#include <linux/backing-dev.h>
+#include <linux/mm.h>
 
 #include "ksrfs.h"
 
@@ -16,28 +19,58 @@ static ssize_t srfs_write(struct file *filp,
 								size_t len,
 								loff_t *ppos);
 
+static ssize_t srfs_aio_read(struct kiocb *iocb,
+								const struct iovec *iov,
+								unsigned long nr_segs,
+								loff_t pos);
+
+static ssize_t srfs_aio_write(struct kiocb *iocb,
+								const struct iovec *iov,
+								unsigned long nr_segs,
+								loff_t pos);
+
 static int srfs_readdir(struct file *filp,
 							void *dirent,
 							filldir_t filldir);
 
+static int srfs_store_mmap(struct file *file, struct vm_area_struct *vma);
+
+extern long srfs_dir_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+extern long srfs_file_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
 
 const struct file_operations srfs_file_ops = {
 	.read = srfs_read,
 	.write = srfs_write,
+	.aio_read = srfs_aio_read,
+	.aio_write = srfs_aio_write,
 	.mmap = srfs_mmap,
+	.unlocked_ioctl = srfs_file_ioctl,
 };
 
 const struct file_operations srfs_dir_ops = {
 	.readdir = srfs_readdir,
+	.unlocked_ioctl = srfs_dir_ioctl,
+	.mmap = srfs_store_mmap,
 };
 
-extern struct srfs_block_info *srfs_alloc_block(struct super_block *sb, struct inode *inode);
+extern int srfs_alloc_blocks(struct super_block *sb, struct inode *inode,
+							uint64_t nr, bool nowait);
+
+extern struct srfs_block_info *srfs_cow_block(struct super_block *sb,
+								struct inode *inode,
+								uint64_t seq,
+								bool nowait);
+
+extern void srfs_dedup_block(struct super_block *sb, struct inode *inode,
+							uint64_t seq, bool nowait);
+
+extern void srfs_unpin_block(struct super_block *sb, struct srfs_block_info *bi);
 
 static struct srfs_block_info *get_file_block(struct inode* inode, uint64_t seq)
 {
 	struct srfs_inode_info *si;
-	struct srfs_block_info *bi;
-	int i = 0;
 
 	printk(KERN_INFO "get_file_block ok 1\n");
 	si = SRFS_INODE(inode);
@@ -52,16 +85,67 @@ static struct srfs_block_info *get_file_block(struct inode* inode, uint64_t seq)
 	}
 
 	printk(KERN_INFO "get_file_block ok 2\n");
-	bi = list_first_entry(&si->data, struct srfs_block_info, list);
-	printk(KERN_INFO "get_file_block ok 3\n");
-	for (; i < seq; i++) {
-		bi = list_next_entry(bi, list);
+	return si->blocks[seq];
+}
+
+/*
+ * Whether a transfer of len bytes should stream past the CPU caches.
+ * Beside the stream= mount option, a file opts in with POSIX_FADV_SEQUENTIAL,
+ * which doubles its readahead window, and opts out with POSIX_FADV_RANDOM.
+ */
+static bool srfs_streaming(struct file *filp, size_t len)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	struct srfs_sb_info *sbi = SRFS_SB(inode->i_sb);
+	struct backing_dev_info *bdi = inode->i_mapping->backing_dev_info;
+
+	if (filp->f_mode & FMODE_RANDOM) {
+		return false;
 	}
 
-	printk(KERN_INFO "get_file_block ok 4\n");
-	return bi;
+	if (bdi && filp->f_ra.ra_pages > bdi->ra_pages) {
+		return true;
+	}
+
+	return sbi->stream_threshold && len >= sbi->stream_threshold;
+}
+
+/*
+ * Take the seq-th block of the file for a copy done without map_sem, so a
+ * fault on the user buffer never waits under it. The file may replace the
+ * block meanwhile (dedup, copy-on-write), but it isn't reused before
+ * srfs_unpin_block. Returns an ERR_PTR on failure, -EAGAIN if a
+ * nonblocking reader would have to wait for map_sem.
+ */
+static struct srfs_block_info *srfs_pin_block(struct inode *inode, uint64_t seq, bool nowait)
+{
+	struct srfs_inode_info *si = SRFS_INODE(inode);
+	struct srfs_group_info *gi;
+	struct srfs_block_info *bi;
+
+	if (!nowait) {
+		down_read(&si->map_sem);
+	} else if (!down_read_trylock(&si->map_sem)) {
+		return ERR_PTR(-EAGAIN);
+	}
+
+	bi = get_file_block(inode, seq);
+	if (bi) {
+		gi = GET_GROUP_BY_BLOCK_ID(inode->i_sb, bi->id);
+		spin_lock(&gi->lock);
+		bi->pins++;
+		spin_unlock(&gi->lock);
+	}
+	up_read(&si->map_sem);
+
+	return bi ? bi : ERR_PTR(-EINVAL);
 }
 
+/*
+ * Readers don't take i_mutex, each block is pinned while it is copied.
+ * A nonblocking (O_NONBLOCK) reader gets -EAGAIN, or a short read, where it
+ * would have to wait for map_sem.
+ */
 static ssize_t srfs_read(struct file *filp, char __user *buf,
 	size_t len, loff_t *ppos)
 {
@@ -70,15 +154,17 @@ static ssize_t srfs_read(struct file *filp, char __user *buf,
 	struct srfs_sb_info *sbi;
 	struct srfs_inode_info *si;
 	struct srfs_group_info *gi;
-	struct srfs_block_info *bi;
+	struct srfs_block_info *bi, *next;
 	uint64_t start_blk, max, left, copy_bytes;
 	char *src, *dst;
+	bool streaming, nowait;
 	int ret;
 
 	inode = filp->f_dentry->d_inode;
 	si = SRFS_INODE(inode);
 	sb = inode->i_sb;
 	sbi = SRFS_SB(sb);
+	nowait = filp->f_flags & O_NONBLOCK;
 
 	printk(KERN_INFO "srfs_read <--\n");
 	printk(KERN_INFO "srfs_read file[%s]: size=%llu, buf_len=%lu\n",
@@ -91,25 +177,41 @@ static ssize_t srfs_read(struct file *filp, char __user *buf,
 
 	len = (len > (si->size - *ppos))?(si->size - *ppos) : len;
 	gi = GET_GROUP_BY_INODE_ID(sb, inode->i_ino);
-	BUG_ON(si->blk_cnt*gi->blk_size < si->size);
 
 	start_blk = (*ppos)/gi->blk_size;
 	/* The space left of the start block should be caculated */
 	max = gi->blk_size - (*ppos)%gi->blk_size;
 	left = len;
 
-	bi = get_file_block(inode, start_blk);
-	if (!bi) {
+	bi = srfs_pin_block(inode, start_blk, nowait);
+	if (IS_ERR(bi)) {
 		printk(KERN_ERR "srfs_read: get file block[%llu] failed\n", start_blk);
-		return -EINVAL;
+		return PTR_ERR(bi);
 	}
 
 	src = bi->addr + gi->blk_size - max;
 	dst = buf;
 	copy_bytes = (max > len)?len : max;
+	streaming = srfs_streaming(filp, len);
 
 	while(1) {
+		next = NULL;
+		if (left > copy_bytes) {
+			next = srfs_pin_block(inode, start_blk + 1, nowait);
+			if (IS_ERR(next)) {
+				next = NULL;
+			}
+		}
+
+		/* Blocks are not contiguous, fetch the next one while copying this one */
+		if (streaming && next) {
+			prefetch_range(next->addr,
+						min_t(uint64_t, left - copy_bytes, gi->blk_size));
+		}
+
 		ret = copy_to_user(dst, src, copy_bytes);
+		srfs_unpin_block(sb, bi);
+		bi = next;
 		if (unlikely(ret)) {
 			printk("copy_to_user returned %d bytes, expecting %llu bytes\n",
 					ret, copy_bytes);
@@ -121,16 +223,20 @@ static ssize_t srfs_read(struct file *filp, char __user *buf,
 
 		*ppos += copy_bytes;
 		left -= copy_bytes;
-		if (left <= 0) {
+		if (left <= 0 || !bi) {
 			break;
 		}
 
-		bi = list_next_entry(bi, list);
+		start_blk++;
 		src = bi->addr;
 		dst += copy_bytes;
 		copy_bytes = (left > gi->blk_size) ? gi->blk_size : left;
 	}
 
+	if (bi) {
+		srfs_unpin_block(sb, bi);
+	}
+
 	if (len > left) {
 		return len - left;
 	}
@@ -138,8 +244,11 @@ static ssize_t srfs_read(struct file *filp, char __user *buf,
 	return -EFAULT;
 }
 
-static ssize_t srfs_write(struct file *filp, const char __user *buf,
-	size_t len, loff_t *ppos)
+/*
+ * Copy user data into the file, the caller holds i_mutex and has done the write checks
+ */
+static ssize_t __srfs_write(struct file *filp, const char __user *buf,
+	size_t len, loff_t *ppos, bool nowait)
 {
 	struct super_block *sb;
 	struct inode *inode;
@@ -149,6 +258,7 @@ static ssize_t srfs_write(struct file *filp, const char __user *buf,
 	struct srfs_block_info *bi;
 	uint64_t start_blk, max, left, copy_bytes;
 	int ret;
+	bool streaming;
 	const char *src, *dst;
 
 	printk("%s <--\n", __func__);
@@ -159,19 +269,6 @@ static ssize_t srfs_write(struct file *filp, const char __user *buf,
 	sb = inode->i_sb;
 	sbi = SRFS_SB(sb);
 
-	ret = generic_write_checks(filp, ppos, &len, 0);
-	if (ret) {
-		return ret;
-	}
-
-	
-	printk(KERN_INFO "srfs_write: offset=%llu, len=%lu\n", *ppos, len);
-	
-	if (GET_GROUP_INDEX(inode->i_ino) != 0) {
-		printk(KERN_INFO "gourp id =%lu\n", GET_GROUP_INDEX(inode->i_ino));
-		return -EINVAL;
-	}
-
 	gi = GET_GROUP_BY_INODE_ID(sb, inode->i_ino);
 	BUG_ON(si->blk_cnt*gi->blk_size < si->size);
 
@@ -187,17 +284,19 @@ static ssize_t srfs_write(struct file *filp, const char __user *buf,
     printk(KERN_INFO "start_blk:%llu, max:%llu, left:%llu\n", start_blk, max, left);
 
     /* try to allocate enough block for writing */
-    while(start_blk >= si->blk_cnt) {
-    	if (!srfs_alloc_block(sb, inode)) {
+    if (start_blk >= si->blk_cnt) {
+    	ret = srfs_alloc_blocks(sb, inode, start_blk + 1 - si->blk_cnt, nowait);
+    	if (ret) {
     		printk(KERN_ERR "srfs_write alloc block failed\n");
-    		return -ENOMEM;
+    		return ret;
     	}
     }
 
-	bi = get_file_block(inode, start_blk);
-	if (!bi) {
+	/* The block may be shared with other files, make it private before modifying */
+	bi = srfs_cow_block(sb, inode, start_blk, nowait);
+	if (IS_ERR(bi)) {
 		printk(KERN_ERR "Can't get file data block!\n");
-		return -EINVAL;
+		return PTR_ERR(bi);
 	}
 
 	printk(KERN_INFO "bi_addr: %p block[%llu] - addr:%p\n", bi, bi->id, bi->addr);
@@ -206,11 +305,21 @@ static ssize_t srfs_write(struct file *filp, const char __user *buf,
 	dst = bi->addr + gi->blk_size - max;
 	copy_bytes = (max > len)?len : max;
 
+	/* Bulk data won't be read back soon, keep it out of the CPU caches */
+	streaming = srfs_streaming(filp, len);
+	if (streaming && !access_ok(VERIFY_READ, buf, len)) {
+		return -EFAULT;
+	}
+
 	printk(KERN_INFO "ready to copy data, src:%p, dst:%p, len:%llu\n", src, dst, copy_bytes);
 
 	while(1) {
 		printk(KERN_INFO "copy_from_user dst:%p src:%p len:%llu\n",dst, src, copy_bytes);
-		ret = copy_from_user((void *)dst, src, copy_bytes);
+		if (streaming) {
+			ret = __copy_from_user_nocache((void *)dst, src, copy_bytes);
+		} else {
+			ret = copy_from_user((void *)dst, src, copy_bytes);
+		}
 		if (unlikely(ret)) {
 			printk(KERN_ERR "copy_from_user not enough bytes returned(%d), expecting(%llu)",
 							ret, copy_bytes);
@@ -221,18 +330,27 @@ static ssize_t srfs_write(struct file *filp, const char __user *buf,
 		}
 
 		left -= copy_bytes;
+
+		/* The block is written up to its end, try to share it with an identical one */
+		if (srfs_test_opt(sbi, DEDUP) && dst + copy_bytes == bi->addr + gi->blk_size) {
+			srfs_dedup_block(sb, inode, start_blk, nowait);
+		}
+
 		if (left <= 0) {
 			break;
 		}
 
 		/* maybe need to request a new block? */
 		if (++start_blk > si->blk_cnt - 1) {
-			if (!srfs_alloc_block(sb, inode)) {
+			if (srfs_alloc_blocks(sb, inode, 1, nowait)) {
 				break;
 			}
 		}
 
-		bi = list_next_entry(bi, list);
+		bi = srfs_cow_block(sb, inode, start_blk, nowait);
+		if (IS_ERR(bi)) {
+			break;
+		}
 		dst = bi->addr;
 		src += copy_bytes;
 		copy_bytes = (left > gi->blk_size) ? gi->blk_size : left;
@@ -241,12 +359,139 @@ static ssize_t srfs_write(struct file *filp, const char __user *buf,
 	if (len > left) {
 		si->size = max(si->size, *ppos + len - left);
 		inode->i_size = si->size;
+		*ppos += len - left;
 		return len - left;
 	}
 
 	return -EFAULT;
 }
 
+/*
+ * Writers are serialized by i_mutex. A nonblocking (O_NONBLOCK) caller never
+ * sleeps on it and gets -EAGAIN instead.
+ */
+static int srfs_write_lock(struct inode *inode, bool nowait)
+{
+	if (!nowait) {
+		mutex_lock(&inode->i_mutex);
+		return 0;
+	}
+
+	return mutex_trylock(&inode->i_mutex) ? 0 : -EAGAIN;
+}
+
+static ssize_t srfs_write(struct file *filp, const char __user *buf,
+	size_t len, loff_t *ppos)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	bool nowait = filp->f_flags & O_NONBLOCK;
+	ssize_t ret;
+
+	printk(KERN_INFO "srfs_write: offset=%llu, len=%lu\n", *ppos, len);
+
+	ret = srfs_write_lock(inode, nowait);
+	if (ret) {
+		return ret;
+	}
+
+	ret = generic_write_checks(filp, ppos, &len, 0);
+	if (ret || len == 0) {
+		goto out;
+	}
+
+	ret = __srfs_write(filp, buf, len, ppos, nowait);
+
+out:
+	mutex_unlock(&inode->i_mutex);
+	return ret;
+}
+
+/*
+ * The data is always in memory, so async requests complete inline on the
+ * submitting thread. O_NONBLOCK requests that would have to wait fail with -EAGAIN.
+ */
+static ssize_t srfs_aio_read(struct kiocb *iocb, const struct iovec *iov,
+	unsigned long nr_segs, loff_t pos)
+{
+	struct file *filp = iocb->ki_filp;
+	ssize_t ret, done = 0;
+	unsigned long seg;
+
+	for (seg = 0; seg < nr_segs; seg++) {
+		/* srfs_read treats an empty transfer as a fault */
+		if (!iov[seg].iov_len) {
+			continue;
+		}
+
+		ret = srfs_read(filp, iov[seg].iov_base, iov[seg].iov_len, &pos);
+		if (ret < 0) {
+			if (!done) {
+				done = ret;
+			}
+			break;
+		}
+
+		done += ret;
+		if (ret < iov[seg].iov_len) {
+			break;
+		}
+	}
+
+	iocb->ki_pos = pos;
+	return done;
+}
+
+static ssize_t srfs_aio_write(struct kiocb *iocb, const struct iovec *iov,
+	unsigned long nr_segs, loff_t pos)
+{
+	struct file *filp = iocb->ki_filp;
+	struct inode *inode = filp->f_dentry->d_inode;
+	bool nowait = filp->f_flags & O_NONBLOCK;
+	size_t count, len;
+	ssize_t ret, done = 0;
+	unsigned long seg;
+
+	count = iov_length(iov, nr_segs);
+
+	ret = srfs_write_lock(inode, nowait);
+	if (ret) {
+		return ret;
+	}
+
+	ret = generic_write_checks(filp, &pos, &count, 0);
+	if (ret || count == 0) {
+		goto out;
+	}
+
+	for (seg = 0; seg < nr_segs && count; seg++) {
+		len = min(count, iov[seg].iov_len);
+		/* __srfs_write would allocate a block at pos and report a fault */
+		if (!len) {
+			continue;
+		}
+
+		ret = __srfs_write(filp, iov[seg].iov_base, len, &pos, nowait);
+		if (ret < 0) {
+			break;
+		}
+
+		done += ret;
+		count -= ret;
+		if (ret < len) {
+			break;
+		}
+	}
+
+	if (done) {
+		ret = done;
+	}
+	iocb->ki_pos = pos;
+
+out:
+	mutex_unlock(&inode->i_mutex);
+	return ret;
+}
+
 static int srfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 {
 	struct super_block *sb;
@@ -275,21 +520,28 @@ static int srfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 		return 0;
 	}
 
-	bi = list_first_entry(&si->data, struct srfs_block_info, list);
+	bi = si->blocks[0];
 	
 	while(1) {
 		eh = (dir_entry_head_t *)(bi->addr + filp->f_pos);
 		ename = (char *)(eh + 1);
 
+		/* skip removed entries */
+		if (eh->ino == DIR_ENTRY_FREE) {
+			goto next;
+		}
+
 		printk(KERN_INFO "filldir: name=%s len=%llu pos=%llu ino=%llu\n",
 						ename, eh->length, filp->f_pos, eh->ino);
-		ret = filldir(dirent, ename, eh->length, filp->f_pos, eh->ino, DT_UNKNOWN);
+		/* length is the size of the slot, a reused one may hold a shorter name */
+		ret = filldir(dirent, ename, strlen(ename), filp->f_pos, eh->ino, DT_UNKNOWN);
 		if (ret) {
 			printk(KERN_INFO "filldir return: %d\n", ret);
 			break;		
 		}
 
-		filp->f_pos += sizeof(*eh) + eh->length;
+next:
+		filp->f_pos += DIR_ENTRY_SIZE(eh);
 		if (filp->f_pos >= si->size) {
 			break;
 		}
@@ -298,10 +550,225 @@ static int srfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 	return 0;
 }
 
+/*
+ * The run of nr blocks from first if it is page aligned and physically
+ * contiguous (see srfs_alloc_block), map_sem must be held
+ */
+static struct srfs_block_info *srfs_block_run(struct srfs_inode_info *si,
+							uint64_t first, uint64_t nr)
+{
+	struct srfs_block_info *bi;
+	uint64_t i;
+
+	if (first + nr > si->blk_cnt) {
+		return NULL;
+	}
+
+	bi = si->blocks[first];
+	if (!PAGE_ALIGNED(bi->addr)) {
+		return NULL;
+	}
+
+	for (i = 1; i < nr; i++) {
+		if (si->blocks[first + i] != bi + i ||
+			GET_GROUP_INDEX(si->blocks[first + i]->id) != GET_GROUP_INDEX(bi->id)) {
+			return NULL;
+		}
+	}
+
+	return bi;
+}
+
+/*
+ * Pages are mapped on fault from the blocks the file has at that time.
+ * Whenever a block of a mapped file is replaced (dedup, copy-on-write) its
+ * page is unmapped under map_sem, so the next access faults the new block
+ * in and a mapping never keeps a block the file gave away. A page whose
+ * blocks are no longer contiguous then gets SIGBUS.
+ */
+static int srfs_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct inode *inode = vma->vm_file->f_dentry->d_inode;
+	struct srfs_inode_info *si = SRFS_INODE(inode);
+	struct srfs_group_info *gi = GET_GROUP_BY_INODE_ID(inode->i_sb, inode->i_ino);
+	struct srfs_block_info *bi;
+	int ret = VM_FAULT_SIGBUS;
+	int err;
+
+	down_read(&si->map_sem);
+	bi = srfs_block_run(si, ((uint64_t)vmf->pgoff << PAGE_SHIFT)/gi->blk_size,
+					PAGE_SIZE/gi->blk_size);
+	if (!bi) {
+		goto out;
+	}
+
+	err = vm_insert_pfn(vma, (unsigned long)vmf->virtual_address,
+					virt_to_phys(bi->addr) >> PAGE_SHIFT);
+	if (!err || err == -EBUSY) {
+		ret = VM_FAULT_NOPAGE;
+	} else if (err == -ENOMEM) {
+		ret = VM_FAULT_OOM;
+	}
+
+out:
+	up_read(&si->map_sem);
+	return ret;
+}
+
+static const struct vm_operations_struct srfs_file_vm_ops = {
+	.fault = srfs_vm_fault,
+};
+
+/*
+ * Files are mapped straight onto their blocks, which is only possible for
+ * page aligned, physically contiguous runs of blocks (see srfs_alloc_block).
+ * The mapping is read only since writes go through copy-on-write blocks.
+ */
 int srfs_mmap(struct file* file, struct vm_area_struct* vma)
 {
+	struct inode *inode;
+	struct srfs_inode_info *si;
+	struct srfs_group_info *gi;
+	uint64_t off, size;
+	int ret = 0;
+
 	printk(KERN_INFO "srfs_mmap <--\n");
-	return -EINVAL;
+
+	inode = file->f_dentry->d_inode;
+	si = SRFS_INODE(inode);
+	gi = GET_GROUP_BY_INODE_ID(inode->i_sb, inode->i_ino);
+
+	if (vma->vm_flags & VM_WRITE) {
+		return -EACCES;
+	}
+
+	off = (uint64_t)vma->vm_pgoff << PAGE_SHIFT;
+	size = vma->vm_end - vma->vm_start;
+
+	/* Every mapped byte must belong to a contiguous run of the file's blocks */
+	down_read(&si->map_sem);
+	if (!srfs_block_run(si, off/gi->blk_size, size/gi->blk_size)) {
+		printk(KERN_INFO "srfs_mmap: range is not a contiguous run of blocks\n");
+		ret = -EINVAL;
+	}
+	up_read(&si->map_sem);
+	if (ret) {
+		return ret;
+	}
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_ops = &srfs_file_vm_ops;
+
+	return 0;
+}
+
+/*
+ * Map the data of a whole group read only, the offset is an SRFS_STORE_ADDR.
+ * This exposes every file of the group, so it is limited to CAP_SYS_RAWIO.
+ */
+static int srfs_store_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct srfs_sb_info *sbi;
+	struct srfs_group_info *gi;
+	uint64_t grp, off, size;
+
+	printk(KERN_INFO "srfs_store_mmap <--\n");
+
+	if (!capable(CAP_SYS_RAWIO)) {
+		return -EPERM;
+	}
+
+	if (vma->vm_flags & VM_WRITE) {
+		return -EACCES;
+	}
+
+	sbi = SRFS_SB(file->f_dentry->d_inode->i_sb);
+	grp = (uint64_t)vma->vm_pgoff >> (GROUP_NR_OFFSET - PAGE_SHIFT);
+	off = ((uint64_t)vma->vm_pgoff << PAGE_SHIFT) & ((1ULL << GROUP_NR_OFFSET) - 1);
+	size = vma->vm_end - vma->vm_start;
+	if (grp >= sbi->group_cnt) {
+		return -EINVAL;
+	}
+
+	gi = &sbi->groups[grp];
+	if (off + size > PAGE_SIZE << gi->data_order) {
+		return -EINVAL;
+	}
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_pfn_range(vma, vma->vm_start,
+						virt_to_phys(gi->data + off) >> PAGE_SHIFT,
+						size, vma->vm_page_prot);
 }
 
+/*
+ * Number of blocks in the extent starting at the seq-th block of the file:
+ * blocks physically following each other in one group which are all
+ * shared or all exclusive. The caller holds i_mutex.
+ */
+uint64_t srfs_block_extent(struct srfs_inode_info *si, uint64_t seq)
+{
+	struct srfs_block_info *bi = si->blocks[seq];
+	struct srfs_block_info *next;
+	bool shared = bi->refcnt > 1;
+	uint64_t nr = 1;
+
+	while (seq + nr < si->blk_cnt) {
+		next = si->blocks[seq + nr];
+		if (next != bi + nr || GET_GROUP_INDEX(next->id) != GET_GROUP_INDEX(bi->id) ||
+			(next->refcnt > 1) != shared) {
+			break;
+		}
+		nr++;
+	}
+
+	return nr;
+}
+
+int srfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+	u64 start, u64 len)
+{
+	struct srfs_inode_info *si;
+	struct srfs_group_info *gi;
+	struct srfs_block_info *bi;
+	uint64_t seq, nr, blk_size;
+	u32 flags;
+	int ret;
+
+	ret = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC);
+	if (ret) {
+		return ret;
+	}
+
+	si = SRFS_INODE(inode);
+	gi = GET_GROUP_BY_INODE_ID(inode->i_sb, inode->i_ino);
+	blk_size = gi->blk_size;
+
+	mutex_lock(&inode->i_mutex);
+	seq = start/blk_size;
+	while (seq < si->blk_cnt && seq*blk_size < start + len) {
+		nr = srfs_block_extent(si, seq);
+		bi = si->blocks[seq];
+
+		flags = 0;
+		if (bi->refcnt > 1) {
+			flags |= FIEMAP_EXTENT_SHARED;
+		}
+		if (seq + nr == si->blk_cnt) {
+			flags |= FIEMAP_EXTENT_LAST;
+		}
 
+		ret = fiemap_fill_next_extent(fieinfo, seq*blk_size,
+					SRFS_STORE_ADDR(GET_GROUP_INDEX(bi->id), GET_OBJ_INDEX(bi->id)*blk_size),
+					nr*blk_size, flags);
+		if (ret) {
+			break;
+		}
+		seq += nr;
+	}
+	mutex_unlock(&inode->i_mutex);
+
+	return ret < 0 ? ret : 0;
+}
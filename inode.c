@@ -1,11 +1,19 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/namei.h>
+#include <linux/slab.h>
 
 #include "ksrfs.h"
 
 struct srfs_block_info *srfs_alloc_block(struct super_block *sb,
 					struct inode *inode);
 
+int srfs_share_blocks(struct inode *dst, struct inode *src);
+
+struct inode *srfs_new_inode(struct inode *dir, umode_t mode);
+
+int srfs_new_inodes(struct inode *dir, umode_t mode, struct inode **inodes, int nr);
+
 static int srfs_create(struct inode *dir,
 			struct dentry *dentry,
 			umode_t mode, 
@@ -19,6 +27,33 @@ static struct dentry *srfs_lookup(struct inode *dir,
 					struct dentry *dentry,
 					unsigned int flags);
 
+static int srfs_unlink(struct inode *dir,
+			struct dentry *dentry);
+
+static int srfs_rmdir(struct inode *dir,
+			struct dentry *dentry);
+
+static int srfs_rename(struct inode *old_dir,
+			struct dentry *old_dentry,
+			struct inode *new_dir,
+			struct dentry *new_dentry);
+
+static int srfs_link(struct dentry *old_dentry,
+			struct inode *dir,
+			struct dentry *dentry);
+
+static int srfs_symlink(struct inode *dir,
+			struct dentry *dentry,
+			const char *symname);
+
+static void *srfs_follow_link(struct dentry *dentry,
+			struct nameidata *nd);
+
+extern int srfs_fiemap(struct inode *inode,
+			struct fiemap_extent_info *fieinfo,
+			u64 start,
+			u64 len);
+
 extern const struct file_operations srfs_file_ops;
 extern const struct file_operations srfs_dir_ops;
 
@@ -26,8 +61,39 @@ const struct inode_operations srfs_inode_ops = {
 	.create = srfs_create,
 	.mkdir = srfs_mkdir,
 	.lookup = srfs_lookup,
+	.unlink = srfs_unlink,
+	.rmdir = srfs_rmdir,
+	.rename = srfs_rename,
+	.link = srfs_link,
+	.symlink = srfs_symlink,
+	.fiemap = srfs_fiemap,
+};
+
+const struct inode_operations srfs_symlink_inode_ops = {
+	.readlink = generic_readlink,
+	.follow_link = srfs_follow_link,
 };
 
+/*
+ * The offset of a dentry's record in its parent directory is cached in
+ * d_fsdata at create and lookup time, so unlink and rename update the
+ * record in place without scanning the directory.
+ */
+static inline void srfs_set_dentry_offset(struct dentry *dentry, uint64_t offset)
+{
+	dentry->d_fsdata = (void *)(unsigned long)offset;
+}
+
+static inline uint64_t srfs_dentry_offset(struct dentry *dentry)
+{
+	return (uint64_t)(unsigned long)dentry->d_fsdata;
+}
+
+static inline dir_entry_head_t *srfs_dir_entry(struct inode *dir, uint64_t offset)
+{
+	return (dir_entry_head_t *)(SRFS_INODE(dir)->blocks[0]->addr + offset);
+}
+
 
 /*
  * Used for initialize speicific fs inode structure when mkdir or create a new file 
@@ -38,7 +104,7 @@ void srfs_init_inode(struct inode *inode, struct inode *dir, umode_t mode)
 
 	inode->i_ino = si->id;
 	inode->i_mode = mode;
-	inode->i_op = &srfs_inode_ops;
+	inode->i_op = S_ISLNK(mode) ? &srfs_symlink_inode_ops : &srfs_inode_ops;
 	inode->i_atime = inode->i_mtime
 					= inode->i_ctime
 					= current_kernel_time();
@@ -49,6 +115,8 @@ void srfs_init_inode(struct inode *inode, struct inode *dir, umode_t mode)
 		inode->i_fop = &srfs_dir_ops;
 	} else if (S_ISREG(mode)) {
 		inode->i_fop = &srfs_file_ops;
+	} else if (S_ISLNK(mode)) {
+		inode->i_fop = NULL;
 	} else {
 		printk(KERN_WARNING "Can't assign file ops for inode %lu\n", inode->i_ino);
 		inode->i_fop = NULL;
@@ -56,29 +124,19 @@ void srfs_init_inode(struct inode *inode, struct inode *dir, umode_t mode)
 }
 
 /*
- * Used for initialize specific fs inode when lookup
+ * Add a record for ino to dir, its offset is returned in pos. The search
+ * for a reusable free record starts at *scan and *scan is moved past the
+ * used records, so a run of inserts under one hold of dir->i_mutex doesn't
+ * rescan the directory each time. scan may be NULL.
  */
-void srfs_fill_inode(struct inode *inode)
-{
-	atomic_set(&inode->i_count, 1);
-	inode->__i_nlink = 1;
-	inode->i_opflags = 0;
-	atomic_set(&inode->i_writecount, 0);
-	atomic_set(&inode->i_dio_count, 0);
-
-#ifdef CONFIG_FSNOTIFY
-	inode->i_fsnotify_mask = 0;
-#endif
-
-	//this_cpu_inc(nr_inodes);
-}
-
-int srfs_dir_add_entry(struct inode *dir,
-			char *name,
-			struct inode *ino)
+static int __srfs_dir_add_entry(struct inode *dir,
+			const char *name,
+			struct inode *ino,
+			uint64_t *pos,
+			uint64_t *scan)
 {
 	struct srfs_inode_info *parent_si;
-	uint64_t ent_size;
+	uint64_t ent_size, name_len, offset, first_free = ~0ULL;
 	dir_entry_head_t *eh;
 	char *ename;
 	struct srfs_block_info *bi;
@@ -90,7 +148,7 @@ int srfs_dir_add_entry(struct inode *dir,
 
 	parent_si = SRFS_INODE(dir);
 
-	if (list_empty(&parent_si->data)) {
+	if (parent_si->blk_cnt == 0) {
 		bi = srfs_alloc_block(dir->i_sb ,dir);
 		if (!bi) {
 			return -ENOMEM;
@@ -99,28 +157,89 @@ int srfs_dir_add_entry(struct inode *dir,
 
 	printk(KERN_INFO "srfs_adir_add_entry after alloc block\n");
 
-	ent_size = sizeof(dir_entry_head_t) + strlen(name) + 1;
+	bi = parent_si->blocks[0];
+	name_len = strlen(name) + 1;
+	ent_size = sizeof(dir_entry_head_t) + name_len;
+
+	/* Reuse the slot of a removed entry if the name fits in */
+	for (offset = scan ? *scan : 0; offset < parent_si->size; offset += DIR_ENTRY_SIZE(eh)) {
+		eh = (dir_entry_head_t *)(bi->addr + offset);
+		if (eh->ino != DIR_ENTRY_FREE) {
+			continue;
+		}
+		if (eh->length >= name_len) {
+			goto fill;
+		}
+		if (first_free == ~0ULL) {
+			first_free = offset;
+		}
+	}
+
 	if (parent_si->size + ent_size > DIR_ENTRY_MAX_SIZE) {
 		printk(KERN_ERR "Not enough space for new direcotry entry %s\n", name);
 		return -ENOSPC;
 	}
 
-	bi = list_first_entry(&parent_si->data , struct srfs_block_info, list);
-	if (unlikely(!bi)) {
-		printk(KERN_WARNING "no data block for this inode\n");
-		return -ENOSPC;
-	}
-	
 	eh = (dir_entry_head_t *)(bi->addr + parent_si->size);
-	eh->ino = ino->i_ino;
-	eh->length = strlen(name) + 1;
+	eh->ino = DIR_ENTRY_FREE;
+	eh->length = name_len;
+	parent_si->size += ent_size;
+
+fill:
 	ename = (char *)(eh + 1);
 	strcpy(ename, name);
-	parent_si->size += ent_size;
+	/* Publish the entry only once its name is complete */
+	smp_wmb();
+	eh->ino = ino->i_ino;
+
+	if (pos) {
+		*pos = offset;
+	}
+
+	if (scan) {
+		*scan = min(first_free, offset + DIR_ENTRY_SIZE(eh));
+	}
 
 	return 0;
 }
 
+int srfs_dir_add_entry(struct inode *dir,
+			char *name,
+			struct inode *ino)
+{
+	return __srfs_dir_add_entry(dir, name, ino, NULL, NULL);
+}
+
+static void srfs_dir_del_entry(struct inode *dir, uint64_t offset)
+{
+	srfs_dir_entry(dir, offset)->ino = DIR_ENTRY_FREE;
+}
+
+/*
+ * A directory is empty when only "." and ".." are left
+ */
+static bool srfs_dir_empty(struct inode *dir)
+{
+	struct srfs_inode_info *si = SRFS_INODE(dir);
+	dir_entry_head_t *eh;
+	uint64_t offset;
+	char *ename;
+
+	for (offset = 0; offset < si->size; offset += DIR_ENTRY_SIZE(eh)) {
+		eh = srfs_dir_entry(dir, offset);
+		if (eh->ino == DIR_ENTRY_FREE) {
+			continue;
+		}
+
+		ename = (char *)(eh + 1);
+		if (strcmp(ename, ".") && strcmp(ename, "..")) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
 static struct dentry *srfs_dir_find_entry(struct inode *dir, 
 						struct dentry *dentry, 
 						unsigned int flags)
@@ -132,34 +251,98 @@ static struct dentry *srfs_dir_find_entry(struct inode *dir,
 	char *ename;
 
 	si = SRFS_INODE(dir);
-	if (list_empty(&si->data)) {
+	if (si->blk_cnt == 0) {
 		return NULL;
 	}
 
-	bi = list_first_entry(&si->data, struct srfs_block_info, list);
+	bi = si->blocks[0];
 	while (si->size > offset) {
 		eh = (dir_entry_head_t *)(bi->addr + offset);
 		ename = (char *)(eh + 1); 
-		if (0 == strcmp(ename, dentry->d_name.name)) {
+		if (eh->ino != DIR_ENTRY_FREE && 0 == strcmp(ename, dentry->d_name.name)) {
 			si = GET_SRFS_INODE_BY_ID(dir->i_sb, eh->ino);
 			if (!si) {
 				printk(KERN_ERR "Can't find requested inode by id %ld\n", (long)eh->ino);
 				return ERR_PTR(-ENOENT);
 			}
 
-			srfs_fill_inode(&si->vfs_inode);
+			/*
+			 * Linked inodes are pinned by their dentry from creation
+			 * on, so this is only reached for an alias of a live inode
+			 */
+			ihold(&si->vfs_inode);
+			srfs_set_dentry_offset(dentry, offset);
 			d_add(dentry, &si->vfs_inode);
+			dget(dentry);
 			return NULL;
 		}
-		offset += eh->length;
+		offset += DIR_ENTRY_SIZE(eh);
 	}
 
 	return NULL;
 }
 
+/*
+ * Add a record of ino to dir and attach it to dentry. The caller's
+ * reference of ino is handed over to the dentry.
+ */
+static int srfs_add_link(struct inode *dir,
+				struct dentry *dentry,
+				struct inode *ino,
+				uint64_t *scan)
+{
+	uint64_t offset;
+	int ret;
+
+	ret = __srfs_dir_add_entry(dir, dentry->d_name.name, ino, &offset, scan);
+	if (ret != 0) {
+		return ret;
+	}
+
+	srfs_set_dentry_offset(dentry, offset);
+	d_add(dentry, ino);
+
+	/*
+	 * Like ramfs, the dentry of a linked inode is pinned until unlink, so
+	 * path walks are served from the dcache in RCU mode and the inode is
+	 * never evicted and refilled behind the walker's back.
+	 */
+	dget(dentry);
+
+	return 0;
+}
+
+/*
+ * Store the target of a symlink, short ones inline so following the link
+ * never touches a data block
+ */
+static int srfs_set_link(struct inode *inode, const char *symname, uint64_t len)
+{
+	struct srfs_inode_info *si = SRFS_INODE(inode);
+	struct srfs_block_info *bi;
+
+	if (len < SRFS_INLINE_LINK_LEN) {
+		si->link = si->inline_link;
+	} else {
+		bi = srfs_alloc_block(inode->i_sb, inode);
+		if (!bi) {
+			return -ENOSPC;
+		}
+		si->link = bi->addr;
+	}
+
+	memcpy(si->link, symname, len);
+	si->link[len] = '\0';
+	si->size = len;
+	inode->i_size = len;
+
+	return 0;
+}
+
 static int __srfs_create_inode(struct inode *dir,
 				struct dentry *dentry,
-				umode_t mode)
+				umode_t mode,
+				const char *symname)
 {
 	struct super_block *sb;
 	struct srfs_sb_info *sbi;
@@ -169,22 +352,31 @@ static int __srfs_create_inode(struct inode *dir,
 	sb = dir->i_sb;
 	sbi = SRFS_SB(sb);
 
-	ino = new_inode(sb);
+	ino = srfs_new_inode(dir, mode);
 	if (!ino) {
-		ret = -ENOMEM;
+		ret = -ENOSPC;
 		goto failed;
 	}
 
 	srfs_init_inode(ino, dir, mode);
-	ret = srfs_dir_add_entry(dir, (char *)dentry->d_name.name, ino);
-	if (ret != 0) {
-		goto failed;
+	if (symname) {
+		ret = srfs_set_link(ino, symname, strlen(symname));
+		if (ret != 0) {
+			goto put_inode;
+		}
 	}
 
-	d_add(dentry, ino);
+	ret = srfs_add_link(dir, dentry, ino, NULL);
+	if (ret != 0) {
+		goto put_inode;
+	}
 
 	return 0;
 
+put_inode:
+	/* Nothing references it, let eviction release it */
+	clear_nlink(ino);
+	iput(ino);
 failed:
 	return ret;
 }
@@ -194,7 +386,83 @@ static int srfs_create(struct inode *dir,
 			umode_t mode, bool excl)
 {
 	printk("%s <--\n", __func__);
-	return __srfs_create_inode(dir, dentry, mode);
+	return __srfs_create_inode(dir, dentry, mode, NULL);
+}
+
+/*
+ * Create a regular file for SRFS_IOC_POPULATE. The caller holds
+ * dir->i_mutex over the whole run of records in dir and ends the batch
+ * before releasing it. Inodes are allocated SRFS_INODE_BATCH at a time and
+ * the search for a free record goes on where the previous insert stopped.
+ */
+int srfs_create_batched(struct inode *dir,
+			struct dentry *dentry,
+			umode_t mode,
+			struct srfs_create_batch *batch)
+{
+	struct inode *inode;
+	int ret;
+
+	if (batch->next == batch->nr) {
+		batch->nr = srfs_new_inodes(dir, mode, batch->inodes, SRFS_INODE_BATCH);
+		batch->next = 0;
+		if (!batch->nr) {
+			return -ENOSPC;
+		}
+	}
+
+	inode = batch->inodes[batch->next++];
+	srfs_init_inode(inode, dir, mode);
+	ret = srfs_add_link(dir, dentry, inode, &batch->scan);
+	if (ret) {
+		clear_nlink(inode);
+		iput(inode);
+	}
+
+	return ret;
+}
+
+/*
+ * Give back the inodes of the batch that were not used
+ */
+void srfs_create_batch_end(struct srfs_create_batch *batch)
+{
+	struct inode *inode;
+
+	while (batch->next < batch->nr) {
+		inode = batch->inodes[batch->next++];
+		clear_nlink(inode);
+		iput(inode);
+	}
+
+	batch->nr = batch->next = 0;
+	batch->scan = 0;
+}
+
+/*
+ * Add "." and ".." to a new directory
+ */
+static int srfs_dir_init(struct inode *inode, struct inode *dir)
+{
+	int ret;
+
+	ret = srfs_dir_add_entry(inode, ".", inode);
+	if (ret) {
+		printk(KERN_ERR "srfs_add_entry %s failed: %d\n", ".", ret);
+		return ret;
+	}
+
+	ret = srfs_dir_add_entry(inode, "..", dir);
+	if (ret) {
+		printk(KERN_ERR "srfs_add_entry %s failed: %d\n", "..", ret);
+		return ret;
+	}
+
+	/* "." of the new directory and its ".." pointing to the parent */
+	set_nlink(inode, 2);
+	inc_nlink(dir);
+
+	return 0;
 }
 
 static int srfs_mkdir(struct inode *dir,
@@ -206,7 +474,7 @@ static int srfs_mkdir(struct inode *dir,
 
 	printk("%s <--\n", __func__);
 	mode |= S_IFDIR;
-	ret = __srfs_create_inode(dir, dentry, mode);
+	ret = __srfs_create_inode(dir, dentry, mode, NULL);
 	if (ret) {
 		printk(KERN_ERR "[srfs_create] __srfs_create_inode failed: %d\n", ret);
 		return ret;
@@ -214,15 +482,8 @@ static int srfs_mkdir(struct inode *dir,
 
 	inode = dentry->d_inode;
 	if (S_ISDIR(inode->i_mode)) {
-		ret = srfs_dir_add_entry(inode, ".", inode);
+		ret = srfs_dir_init(inode, dir);
 		if (ret) {
-			printk(KERN_ERR "srfs_add_entry %s failed: %d\n", ".", ret);
-			return ret;
-		}
-
-		ret = srfs_dir_add_entry(inode, "..", dir);
-		if (ret) {
-			printk(KERN_ERR "srfs_add_entry %s failed: %d\n", "..", ret);
 			return ret;
 		}
 	}
@@ -237,3 +498,322 @@ static struct dentry *srfs_lookup(struct inode *dir,
 	printk("%s <--\n", __func__);
 	return srfs_dir_find_entry(dir, dentry, flags);
 }
+
+static int srfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = dentry->d_inode;
+
+	printk("%s <--\n", __func__);
+	srfs_dir_del_entry(dir, srfs_dentry_offset(dentry));
+
+	inode->i_ctime = dir->i_ctime = dir->i_mtime = CURRENT_TIME;
+	drop_nlink(inode);
+	dput(dentry);
+
+	return 0;
+}
+
+static int srfs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = dentry->d_inode;
+
+	printk("%s <--\n", __func__);
+	if (!srfs_dir_empty(inode)) {
+		return -ENOTEMPTY;
+	}
+
+	srfs_dir_del_entry(dir, srfs_dentry_offset(dentry));
+
+	inode->i_ctime = dir->i_ctime = dir->i_mtime = CURRENT_TIME;
+	clear_nlink(inode);
+	drop_nlink(dir);
+	dput(dentry);
+
+	return 0;
+}
+
+/*
+ * A hard link only adds a record, the data blocks stay with the inode
+ */
+static int srfs_link(struct dentry *old_dentry,
+			struct inode *dir,
+			struct dentry *dentry)
+{
+	struct inode *inode = old_dentry->d_inode;
+	int ret;
+
+	printk("%s <--\n", __func__);
+	ihold(inode);
+	ret = srfs_add_link(dir, dentry, inode, NULL);
+	if (ret) {
+		iput(inode);
+		return ret;
+	}
+
+	inode->i_ctime = dir->i_ctime = dir->i_mtime = CURRENT_TIME;
+	inc_nlink(inode);
+
+	return 0;
+}
+
+static int srfs_symlink(struct inode *dir,
+			struct dentry *dentry,
+			const char *symname)
+{
+	printk("%s <--\n", __func__);
+	if (strlen(symname) >= SRFS_BLOCK_SIZE) {
+		return -ENAMETOOLONG;
+	}
+
+	return __srfs_create_inode(dir, dentry, S_IFLNK | S_IRWXUGO, symname);
+}
+
+static void *srfs_follow_link(struct dentry *dentry, struct nameidata *nd)
+{
+	nd_set_link(nd, SRFS_INODE(dentry->d_inode)->link);
+	return NULL;
+}
+
+/*
+ * Rename never rewrites or rescans the directories: an existing target
+ * record gets the new inode id in a single store, a name fitting the old
+ * slot is rewritten in place, otherwise a record is added to new_dir before
+ * the old one is removed. Readers always find either the old or the new file.
+ */
+static int srfs_rename(struct inode *old_dir, struct dentry *old_dentry,
+			struct inode *new_dir, struct dentry *new_dentry)
+{
+	struct inode *inode = old_dentry->d_inode;
+	struct inode *target = new_dentry->d_inode;
+	bool is_dir = S_ISDIR(inode->i_mode);
+	uint64_t old_off, new_off;
+	dir_entry_head_t *eh;
+	int ret;
+
+	printk("%s <--\n", __func__);
+
+	if (target && is_dir && !srfs_dir_empty(target)) {
+		return -ENOTEMPTY;
+	}
+
+	old_off = srfs_dentry_offset(old_dentry);
+	eh = srfs_dir_entry(old_dir, old_off);
+
+	if (target) {
+		new_off = srfs_dentry_offset(new_dentry);
+		ACCESS_ONCE(srfs_dir_entry(new_dir, new_off)->ino) = inode->i_ino;
+	} else if (old_dir == new_dir && eh->length > new_dentry->d_name.len) {
+		new_off = old_off;
+		strcpy((char *)(eh + 1), new_dentry->d_name.name);
+	} else {
+		ret = __srfs_dir_add_entry(new_dir, new_dentry->d_name.name, inode, &new_off, NULL);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	if (old_dir != new_dir || old_off != new_off) {
+		srfs_dir_del_entry(old_dir, old_off);
+	}
+	srfs_set_dentry_offset(old_dentry, new_off);
+
+	if (target) {
+		target->i_ctime = CURRENT_TIME;
+		if (is_dir) {
+			clear_nlink(target);
+			drop_nlink(new_dir);
+		} else {
+			drop_nlink(target);
+		}
+		dput(new_dentry);
+	}
+
+	if (is_dir && old_dir != new_dir) {
+		/* ".." is always the second record of a directory */
+		eh = srfs_dir_entry(inode, 0);
+		eh = (dir_entry_head_t *)((char *)eh + DIR_ENTRY_SIZE(eh));
+		eh->ino = new_dir->i_ino;
+		drop_nlink(old_dir);
+		inc_nlink(new_dir);
+	}
+
+	old_dir->i_ctime = old_dir->i_mtime = CURRENT_TIME;
+	new_dir->i_ctime = new_dir->i_mtime = CURRENT_TIME;
+	inode->i_ctime = CURRENT_TIME;
+
+	return 0;
+}
+
+/*
+ * Create dentry in dir as a clone of src, dir->i_mutex must be held.
+ * Regular files share the data blocks of src, symlinks get its target and
+ * directories are created empty, srfs_clone_tree fills them. The clone is
+ * owned by the caller, so it must be allowed to read src in the first place.
+ */
+static int srfs_clone_inode(struct inode *dir, struct dentry *dentry,
+			struct inode *src)
+{
+	struct inode *inode;
+	int mask = 0;
+	int ret;
+
+	if (S_ISDIR(src->i_mode)) {
+		mask = MAY_READ | MAY_EXEC;
+	} else if (S_ISREG(src->i_mode)) {
+		mask = MAY_READ;
+	}
+
+	if (mask) {
+		ret = inode_permission(src, mask);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	ret = __srfs_create_inode(dir, dentry, src->i_mode,
+				S_ISLNK(src->i_mode) ? SRFS_INODE(src)->link : NULL);
+	if (ret) {
+		return ret;
+	}
+
+	inode = dentry->d_inode;
+	if (S_ISREG(src->i_mode)) {
+		/* Keep writers from modifying blocks in place while they become shared */
+		mutex_lock_nested(&src->i_mutex, I_MUTEX_CHILD);
+		ret = srfs_share_blocks(inode, src);
+		mutex_unlock(&src->i_mutex);
+		return ret;
+	}
+
+	if (S_ISDIR(src->i_mode)) {
+		return srfs_dir_init(inode, dir);
+	}
+
+	return 0;
+}
+
+struct srfs_clone_ent {
+	struct inode *inode;
+	char name[NAME_MAX + 1];
+};
+
+/*
+ * Copy the records of the directory src under its i_mutex, holding a
+ * reference to each inode, so the clone is made from a consistent listing
+ * without keeping src locked while the clone is created
+ */
+static struct srfs_clone_ent *srfs_clone_list(struct inode *src,
+			unsigned long top, int *nr)
+{
+	struct srfs_inode_info *src_si = SRFS_INODE(src);
+	struct srfs_clone_ent *ents;
+	dir_entry_head_t *eh;
+	uint64_t offset;
+	char *ename;
+	int cnt = 0;
+
+	mutex_lock(&src->i_mutex);
+	for (offset = 0; offset < src_si->size; offset += DIR_ENTRY_SIZE(eh)) {
+		eh = srfs_dir_entry(src, offset);
+		cnt++;
+	}
+
+	ents = kcalloc(cnt ? cnt : 1, sizeof(*ents), GFP_KERNEL);
+	if (!ents) {
+		mutex_unlock(&src->i_mutex);
+		return NULL;
+	}
+
+	*nr = 0;
+	for (offset = 0; offset < src_si->size; offset += DIR_ENTRY_SIZE(eh)) {
+		eh = srfs_dir_entry(src, offset);
+		ename = (char *)(eh + 1);
+		if (eh->ino == DIR_ENTRY_FREE || eh->ino == top ||
+			!strcmp(ename, ".") || !strcmp(ename, "..")) {
+			continue;
+		}
+
+		ents[*nr].inode = &GET_SRFS_INODE_BY_ID(src->i_sb, eh->ino)->vfs_inode;
+		ihold(ents[*nr].inode);
+		strlcpy(ents[*nr].name, ename, sizeof(ents[*nr].name));
+		(*nr)++;
+	}
+	mutex_unlock(&src->i_mutex);
+
+	return ents;
+}
+
+/*
+ * Clone the entries of the directory src into the clone dentry. No lock is
+ * held on entry: src and the clone are locked one at a time, so cloning a
+ * tree into itself or next to a concurrent rename can't deadlock. top is the
+ * inode id of the top level clone, so a tree cloned into itself doesn't
+ * descend into the copy.
+ */
+static int srfs_clone_children(struct dentry *dentry, struct inode *src,
+			unsigned long top, int depth)
+{
+	struct inode *inode = dentry->d_inode;
+	struct srfs_clone_ent *ents;
+	struct dentry *child_dentry;
+	int i, nr, ret = 0;
+
+	if (depth > SRFS_CLONE_MAX_DEPTH) {
+		return -ELOOP;
+	}
+
+	ents = srfs_clone_list(src, top, &nr);
+	if (!ents) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr && !ret; i++) {
+		mutex_lock_nested(&inode->i_mutex, I_MUTEX_PARENT);
+		child_dentry = lookup_one_len(ents[i].name, dentry, strlen(ents[i].name));
+		if (IS_ERR(child_dentry)) {
+			ret = PTR_ERR(child_dentry);
+			mutex_unlock(&inode->i_mutex);
+			break;
+		}
+
+		if (child_dentry->d_inode) {
+			ret = -EEXIST;
+		} else {
+			ret = srfs_clone_inode(inode, child_dentry, ents[i].inode);
+		}
+		mutex_unlock(&inode->i_mutex);
+
+		if (!ret && S_ISDIR(ents[i].inode->i_mode)) {
+			ret = srfs_clone_children(child_dentry, ents[i].inode, top, depth + 1);
+		}
+		dput(child_dentry);
+	}
+
+	for (i = 0; i < nr; i++) {
+		iput(ents[i].inode);
+	}
+	kfree(ents);
+
+	return ret;
+}
+
+/*
+ * Clone src as the negative dentry in dir, dir->i_mutex must be held. A
+ * directory is only created, srfs_clone_tree fills it once dir is unlocked.
+ * Like cp -r, the clone is visible while being populated and is left in
+ * place on failure.
+ */
+int srfs_clone(struct inode *dir, struct dentry *dentry, struct inode *src)
+{
+	printk("%s <--\n", __func__);
+	return srfs_clone_inode(dir, dentry, src);
+}
+
+int srfs_clone_tree(struct dentry *dentry, struct inode *src)
+{
+	if (!S_ISDIR(src->i_mode)) {
+		return 0;
+	}
+
+	return srfs_clone_children(dentry, src, dentry->d_inode->i_ino, 1);
+}
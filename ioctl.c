@@ -0,0 +1,433 @@
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/mount.h>
+#include <linux/namei.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/security.h>
+#include <linux/fsnotify.h>
+
+#include "ksrfs.h"
+
+extern int srfs_clone(struct inode *dir, struct dentry *dentry, struct inode *src);
+
+extern int srfs_clone_tree(struct dentry *dentry, struct inode *src);
+
+extern int srfs_create_batched(struct inode *dir, struct dentry *dentry,
+			umode_t mode, struct srfs_create_batch *batch);
+
+extern void srfs_create_batch_end(struct srfs_create_batch *batch);
+
+extern int srfs_alloc_blocks(struct super_block *sb, struct inode *inode,
+							uint64_t nr, bool nowait);
+
+extern void srfs_dedup_block(struct super_block *sb, struct inode *inode,
+							uint64_t seq, bool nowait);
+
+extern uint64_t srfs_block_extent(struct srfs_inode_info *si, uint64_t seq);
+
+static long srfs_ioc_clone(struct file *filp, struct srfs_clone_args __user *uarg)
+{
+	struct srfs_clone_args args;
+	struct inode *dir, *src;
+	struct dentry *dentry;
+	struct file *src_filp;
+	size_t len;
+	long ret;
+
+	if (copy_from_user(&args, uarg, sizeof(args))) {
+		return -EFAULT;
+	}
+
+	args.name[NAME_MAX] = '\0';
+	len = strlen(args.name);
+	if (len == 0 || strchr(args.name, '/') ||
+		!strcmp(args.name, ".") || !strcmp(args.name, "..")) {
+		return -EINVAL;
+	}
+
+	src_filp = fget(args.src_fd);
+	if (!src_filp) {
+		return -EBADF;
+	}
+
+	/* The clone is readable by the caller, so must be the source */
+	ret = -EBADF;
+	if (!(src_filp->f_mode & FMODE_READ)) {
+		goto out_fput;
+	}
+
+	dir = filp->f_dentry->d_inode;
+	src = src_filp->f_dentry->d_inode;
+
+	ret = -EXDEV;
+	if (src->i_sb != dir->i_sb) {
+		goto out_fput;
+	}
+
+	ret = -EINVAL;
+	if (!S_ISREG(src->i_mode) && !S_ISDIR(src->i_mode)) {
+		goto out_fput;
+	}
+
+	ret = mnt_want_write(filp->f_path.mnt);
+	if (ret) {
+		goto out_fput;
+	}
+
+	ret = inode_permission(dir, MAY_WRITE | MAY_EXEC);
+	if (ret) {
+		goto out_drop_write;
+	}
+
+	mutex_lock_nested(&dir->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(args.name, filp->f_dentry, len);
+	if (IS_ERR(dentry)) {
+		ret = PTR_ERR(dentry);
+		goto out_unlock;
+	}
+
+	if (dentry->d_inode) {
+		ret = -EEXIST;
+	} else {
+		ret = srfs_clone(dir, dentry, src);
+	}
+	mutex_unlock(&dir->i_mutex);
+
+	/* The tree is filled with dir unlocked, src may be one of its ancestors */
+	if (!ret) {
+		ret = srfs_clone_tree(dentry, src);
+	}
+	dput(dentry);
+	goto out_drop_write;
+
+out_unlock:
+	mutex_unlock(&dir->i_mutex);
+out_drop_write:
+	mnt_drop_write(filp->f_path.mnt);
+out_fput:
+	fput(src_filp);
+	return ret;
+}
+
+/*
+ * Resolve the directory path relative to base, path is consumed
+ */
+static struct dentry *srfs_populate_walk(struct dentry *base, char *path)
+{
+	struct dentry *dentry, *child;
+	char *name;
+
+	dentry = dget(base);
+	while ((name = strsep(&path, "/")) != NULL) {
+		if (!*name) {
+			continue;
+		}
+
+		mutex_lock(&dentry->d_inode->i_mutex);
+		child = lookup_one_len(name, dentry, strlen(name));
+		mutex_unlock(&dentry->d_inode->i_mutex);
+		dput(dentry);
+		if (IS_ERR(child)) {
+			return child;
+		}
+
+		if (!child->d_inode) {
+			dput(child);
+			return ERR_PTR(-ENOENT);
+		}
+
+		if (!S_ISDIR(child->d_inode->i_mode)) {
+			dput(child);
+			return ERR_PTR(-ENOTDIR);
+		}
+
+		dentry = child;
+	}
+
+	return dentry;
+}
+
+/*
+ * Fill a new file with len bytes of user data, all blocks are taken at once
+ */
+static int srfs_populate_data(struct inode *inode, const char __user *data, uint64_t len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct srfs_inode_info *si = SRFS_INODE(inode);
+	struct srfs_group_info *gi = GET_GROUP_BY_INODE_ID(sb, inode->i_ino);
+	uint64_t i, nr, copy_bytes, done = 0;
+	int ret;
+
+	nr = DIV_ROUND_UP(len, gi->blk_size);
+	ret = srfs_alloc_blocks(sb, inode, nr, false);
+	if (ret) {
+		return ret;
+	}
+
+	for (i = 0; i < nr; i++) {
+		copy_bytes = min(len - done, gi->blk_size);
+		if (copy_from_user(si->blocks[i]->addr, data + done, copy_bytes)) {
+			return -EFAULT;
+		}
+		done += copy_bytes;
+
+		if (srfs_test_opt(SRFS_SB(sb), DEDUP) && copy_bytes == gi->blk_size) {
+			srfs_dedup_block(sb, inode, i, false);
+		}
+
+		si->size = done;
+		inode->i_size = done;
+	}
+
+	return 0;
+}
+
+/*
+ * Create every record of the buffer. Consecutive records in one directory
+ * share a single path walk, permission check and hold of the directory's
+ * i_mutex, their inodes are allocated in batches and their records are
+ * inserted without rescanning the directory. The blocks of a file are
+ * allocated at once.
+ */
+static long srfs_ioc_populate(struct file *filp, struct srfs_populate_args __user *uarg)
+{
+	struct srfs_populate_args args;
+	struct srfs_populate_rec rec;
+	struct srfs_create_batch *batch;
+	struct dentry *parent = NULL, *dentry;
+	struct inode *dir = NULL;
+	char *path, *dir_path, *leaf;
+	const char __user *ubuf;
+	uint64_t pos = 0, done = 0;
+	size_t dir_len;
+	umode_t mode;
+	long ret = 0;
+
+	if (copy_from_user(&args, uarg, sizeof(args))) {
+		return -EFAULT;
+	}
+
+	ubuf = (const char __user *)(unsigned long)args.buf;
+
+	/* the record path and the path of the directory it was created in */
+	path = kmalloc(2*PATH_MAX, GFP_KERNEL);
+	if (!path) {
+		return -ENOMEM;
+	}
+	dir_path = path + PATH_MAX;
+
+	batch = kzalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch) {
+		kfree(path);
+		return -ENOMEM;
+	}
+
+	ret = mnt_want_write(filp->f_path.mnt);
+	if (ret) {
+		goto out_free;
+	}
+
+	while (pos + sizeof(rec) <= args.len) {
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		ret = -EFAULT;
+		if (copy_from_user(&rec, ubuf + pos, sizeof(rec))) {
+			break;
+		}
+
+		ret = -EINVAL;
+		if (rec.path_len == 0 || rec.path_len >= PATH_MAX ||
+			rec.path_len > args.len - pos - sizeof(rec) ||
+			rec.data_len > args.len - pos - sizeof(rec) - rec.path_len) {
+			break;
+		}
+
+		ret = -EFAULT;
+		if (copy_from_user(path, ubuf + pos + sizeof(rec), rec.path_len)) {
+			break;
+		}
+		path[rec.path_len] = '\0';
+
+		leaf = strrchr(path, '/');
+		if (leaf) {
+			*leaf++ = '\0';
+		} else {
+			leaf = path;
+		}
+		dir_len = (leaf == path) ? 0 : strlen(path);
+
+		/* Walk to the parent unless the previous record was in the same directory */
+		if (!parent || dir_len != strlen(dir_path) || strncmp(path, dir_path, dir_len)) {
+			if (parent) {
+				srfs_create_batch_end(batch);
+				mutex_unlock(&dir->i_mutex);
+				dput(parent);
+			}
+
+			memcpy(dir_path, path, dir_len);
+			dir_path[dir_len] = '\0';
+			parent = srfs_populate_walk(filp->f_dentry, path);
+			if (IS_ERR(parent)) {
+				ret = PTR_ERR(parent);
+				parent = NULL;
+				break;
+			}
+
+			dir = parent->d_inode;
+			mutex_lock_nested(&dir->i_mutex, I_MUTEX_PARENT);
+
+			/* What vfs_create would check for each file */
+			ret = inode_permission(dir, MAY_WRITE | MAY_EXEC);
+			if (!ret && IS_DEADDIR(dir)) {
+				ret = -ENOENT;
+			}
+			if (ret) {
+				break;
+			}
+		}
+
+		dentry = lookup_one_len(leaf, parent, strlen(leaf));
+		if (IS_ERR(dentry)) {
+			ret = PTR_ERR(dentry);
+			break;
+		}
+
+		mode = rec.mode & ~current_umask();
+		if (dentry->d_inode) {
+			ret = -EEXIST;
+		} else if (S_ISDIR(rec.mode)) {
+			ret = vfs_mkdir(dir, dentry, mode & S_IALLUGO);
+		} else if (S_ISREG(rec.mode) || !(rec.mode & S_IFMT)) {
+			mode = (mode & S_IALLUGO) | S_IFREG;
+			ret = security_inode_create(dir, dentry, mode);
+			if (!ret) {
+				ret = srfs_create_batched(dir, dentry, mode, batch);
+			}
+			if (!ret) {
+				fsnotify_create(dir, dentry);
+			}
+			if (!ret && rec.data_len) {
+				mutex_lock_nested(&dentry->d_inode->i_mutex, I_MUTEX_CHILD);
+				ret = srfs_populate_data(dentry->d_inode,
+							ubuf + pos + sizeof(rec) + rec.path_len,
+							rec.data_len);
+				mutex_unlock(&dentry->d_inode->i_mutex);
+			}
+		} else {
+			ret = -EINVAL;
+		}
+		dput(dentry);
+
+		if (ret) {
+			break;
+		}
+
+		pos += SRFS_POPULATE_REC_SIZE(&rec);
+		done++;
+	}
+
+	if (parent) {
+		srfs_create_batch_end(batch);
+		mutex_unlock(&dir->i_mutex);
+		dput(parent);
+	}
+
+	mnt_drop_write(filp->f_path.mnt);
+
+out_free:
+	kfree(batch);
+	kfree(path);
+	if (put_user(done, &uarg->done)) {
+		return -EFAULT;
+	}
+
+	return ret;
+}
+
+long srfs_dir_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	printk(KERN_INFO "srfs_dir_ioctl cmd=%u\n", cmd);
+
+	switch (cmd) {
+	case SRFS_IOC_CLONE:
+		return srfs_ioc_clone(filp, (struct srfs_clone_args __user *)arg);
+	case SRFS_IOC_POPULATE:
+		return srfs_ioc_populate(filp, (struct srfs_populate_args __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static long srfs_ioc_get_extents(struct file *filp, struct srfs_extents_args __user *uarg)
+{
+	struct srfs_extents_args args;
+	struct srfs_extent ext;
+	struct srfs_extent __user *uext;
+	struct inode *inode;
+	struct srfs_inode_info *si;
+	struct srfs_group_info *gi;
+	struct srfs_block_info *bi;
+	uint64_t seq, nr;
+	uint32_t filled = 0;
+	long ret = 0;
+
+	if (copy_from_user(&args, uarg, sizeof(args))) {
+		return -EFAULT;
+	}
+
+	inode = filp->f_dentry->d_inode;
+	si = SRFS_INODE(inode);
+	gi = GET_GROUP_BY_INODE_ID(inode->i_sb, inode->i_ino);
+	uext = (struct srfs_extent __user *)(unsigned long)args.extents;
+
+	mutex_lock(&inode->i_mutex);
+	seq = args.start/gi->blk_size;
+	while (seq < si->blk_cnt && filled < args.count) {
+		nr = srfs_block_extent(si, seq);
+		bi = si->blocks[seq];
+
+		memset(&ext, 0, sizeof(ext));
+		ext.logical = seq*gi->blk_size;
+		ext.group = GET_GROUP_INDEX(bi->id);
+		ext.offset = GET_OBJ_INDEX(bi->id)*gi->blk_size;
+		ext.length = nr*gi->blk_size;
+		if (bi->refcnt > 1) {
+			ext.flags |= SRFS_EXTENT_SHARED;
+		}
+		if (seq + nr == si->blk_cnt) {
+			ext.flags |= SRFS_EXTENT_LAST;
+		}
+
+		if (copy_to_user(uext + filled, &ext, sizeof(ext))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		filled++;
+		seq += nr;
+	}
+	mutex_unlock(&inode->i_mutex);
+
+	if (put_user(filled, &uarg->count)) {
+		return -EFAULT;
+	}
+
+	return ret;
+}
+
+long srfs_file_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	printk(KERN_INFO "srfs_file_ioctl cmd=%u\n", cmd);
+
+	switch (cmd) {
+	case SRFS_IOC_GET_EXTENTS:
+		return srfs_ioc_get_extents(filp, (struct srfs_extents_args __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
@@ -3,6 +3,12 @@
 
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/llist.h>
+#include <linux/spinlock.h>
+#include <linux/ioctl.h>
+#include <linux/workqueue.h>
+#include <linux/percpu_counter.h>
 
 #define SRFS_SUPER_MAGIC 0x20160622
 
@@ -25,8 +31,111 @@
 /* Calculate id with group index and obj index */
 #define GENERATE_ID(grp_idx, obj_idx) (((grp_idx << GROUP_NR_OFFSET) | obj_idx) + INODE_ID_BASE)
 
+/*
+ * Address of a byte in the data of a group, as reported by FIEMAP and
+ * SRFS_IOC_GET_EXTENTS and used as mmap offset of a directory
+ */
+#define SRFS_STORE_ADDR(grp_idx, off) (((uint64_t)(grp_idx) << GROUP_NR_OFFSET) | (off))
+
 #define DIR_ENTRY_MAX_SIZE SRFS_BLOCK_SIZE
 
+/* Buckets of the per group dedup table, in bits */
+#define SRFS_DEDUP_HASH_BITS 6
+
+/* Mount options */
+#define SRFS_MOUNT_DEDUP 0x0001
+#define SRFS_MOUNT_HUGE 0x0002
+
+#define srfs_test_opt(sbi, opt) ((sbi)->mount_opt & SRFS_MOUNT_##opt)
+
+/* Files with more blocks are freed by the background workqueue */
+#define SRFS_ASYNC_FREE_BLOCKS 1024
+
+/* Blocks given back per hold of the group lock when freeing */
+#define SRFS_FREE_BATCH 256
+
+/* Deepest directory tree SRFS_IOC_CLONE walks */
+#define SRFS_CLONE_MAX_DEPTH 32
+
+/* Inodes SRFS_IOC_POPULATE allocates at once for a directory */
+#define SRFS_INODE_BATCH 32
+
+/* Symlink targets shorter than this are kept in the inode itself */
+#define SRFS_INLINE_LINK_LEN 64
+
+/*
+ * ioctl interface
+ */
+#define SRFS_IOC_MAGIC 0xf2
+
+/*
+ * Issued on a directory, creates name in it as a copy-on-write clone of the
+ * file or directory tree opened as src_fd
+ */
+struct srfs_clone_args {
+	int64_t src_fd;
+	char name[NAME_MAX + 1];
+};
+
+#define SRFS_IOC_CLONE _IOW(SRFS_IOC_MAGIC, 1, struct srfs_clone_args)
+
+/*
+ * Issued on a directory, creates every record of the buffer in one call.
+ * Paths are relative to the directory and their parents must exist or be
+ * created by an earlier record. done returns the number of records created.
+ */
+struct srfs_populate_args {
+	uint64_t buf;
+	uint64_t len;
+	uint64_t done;
+};
+
+/*
+ * A record of the populate buffer, followed by path_len bytes of path
+ * (not NUL terminated) and data_len bytes of data, padded to 8 bytes.
+ * S_IFDIR records carry no data, records without a type are regular files.
+ */
+struct srfs_populate_rec {
+	uint32_t mode;
+	uint32_t path_len;
+	uint64_t data_len;
+};
+
+#define SRFS_POPULATE_REC_SIZE(rec) \
+	ALIGN(sizeof(struct srfs_populate_rec) + (rec)->path_len + (rec)->data_len, 8)
+
+#define SRFS_IOC_POPULATE _IOWR(SRFS_IOC_MAGIC, 2, struct srfs_populate_args)
+
+/*
+ * A run of file blocks physically contiguous in one group store
+ */
+struct srfs_extent {
+	uint64_t logical;
+	uint64_t group;
+	/* byte offset in the data of the group */
+	uint64_t offset;
+	uint64_t length;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+/* srfs_extent flags */
+#define SRFS_EXTENT_SHARED 0x0001
+#define SRFS_EXTENT_LAST 0x0002
+
+/*
+ * Issued on a regular file, fills up to count extents starting from the
+ * block holding byte start. count returns the number of extents filled.
+ */
+struct srfs_extents_args {
+	uint64_t start;
+	uint64_t extents;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+#define SRFS_IOC_GET_EXTENTS _IOWR(SRFS_IOC_MAGIC, 3, struct srfs_extents_args)
+
 struct srfs_group_info {
 	uint64_t id;
 
@@ -35,14 +144,38 @@ struct srfs_group_info {
 	uint64_t blk_cnt;
 
 	uint64_t blk_size;
+
+	/* free inodes and blocks left, read without the lock for placement hints */
+	uint64_t ino_avail;
+	uint64_t blk_avail;
 	
 	/* point to the index of next free inode */
 	struct list_head ino_free;
 
+	/*
+	 * Inodes freed by srfs_i_callback. It runs in softirq context and
+	 * can't take the lock, srfs_take_inodes moves them to ino_free.
+	 */
+	struct llist_head ino_rcu_free;
+
 	/* point to the index of next free block */
 	struct list_head blk_free;
 
+	/* inode and block descriptors */
 	char *store;
+
+	/* block descriptors, part of store */
+	struct srfs_block_info *blk_info;
+
+	/* block data, physically contiguous pages of data_order */
+	char *data;
+	unsigned int data_order;
+
+	/* protect free lists, block reference counts and the dedup table */
+	spinlock_t lock;
+
+	/* fully written file blocks indexed by content hash */
+	DECLARE_HASHTABLE(dedup, SRFS_DEDUP_HASH_BITS);
 };
 
 struct srfs_sb_info {
@@ -51,27 +184,69 @@ struct srfs_sb_info {
 
 	uint8_t group_cnt;
 
-	/* record the last time inode allocation group */
+	/*
+	 * record the last time inode allocation group, updated without a lock,
+	 * so it is computed in a local and only valid indexes are stored
+	 */
 	uint8_t last_group;
 
+	/* SRFS_MOUNT_* flags */
+	unsigned long mount_opt;
+
+	/* Reads and writes of at least this many bytes bypass the CPU caches, 0 to disable */
+	unsigned int stream_threshold;
+
 	struct srfs_group_info *groups;
+
+	/* frees the blocks of large unlinked files */
+	struct workqueue_struct *free_wq;
+
+	/* size= and nr_inodes= limits, 0 when only the group stores limit the mount */
+	uint64_t max_blocks;
+	uint64_t max_inodes;
+
+	/* Blocks and inodes in use, reserved before they are taken from a group */
+	struct percpu_counter used_blocks;
+	struct percpu_counter used_inodes;
 };
 
 struct srfs_inode_info {
 	uint64_t id;
 
-	/* list head of data block list */
-	struct list_head data;
+	/*
+	 * Block map, the n-th entry is the n-th data block of the file.
+	 * Several map entries (of the same or other inodes) may reference
+	 * a single deduplicated block.
+	 */
+	struct srfs_block_info **blocks;
+
+	/* Slots available in the block map */
+	uint64_t blk_cap;
+
+	/*
+	 * Readers not holding i_mutex take it shared while looking up blocks
+	 * in the map, growing the map or replacing/dropping one of its entries
+	 * takes it exclusive. It is never held across a user copy, readers pin
+	 * the block they copy from instead.
+	 */
+	struct rw_semaphore map_sem;
 
 	/* Inserted into ino_free field of srfs_group_info */
 	struct list_head list;
 
+	/* Inserted into ino_rcu_free field of srfs_group_info */
+	struct llist_node rcu_free;
+
 	/* Actually written bytes */
 	uint64_t size;
 
 	/* Block count */
 	uint64_t blk_cnt;
 
+	/* Symlink target, points to inline_link or to the first data block */
+	char *link;
+	char inline_link[SRFS_INLINE_LINK_LEN];
+
 	/* vfs indeo part */
 	struct inode vfs_inode;
 };
@@ -80,10 +255,23 @@ struct srfs_block_info {
 	uint64_t id;
 
 	char *addr;
-	/* 
-	 * inked to data filed of srfs_inode_info after allocated
-	 * or blk_free of srfs_group_info otherwise
+
+	/* Number of block map entries referencing this block, 0 if free */
+	uint32_t refcnt;
+
+	/* crc32c of the content, valid while linked in the dedup table */
+	uint32_t hash;
+
+	/*
+	 * Readers copying from the block without map_sem, see srfs_pin_block.
+	 * A pinned block is freed only once the last pin is dropped.
 	 */
+	uint32_t pins;
+
+	/* Linked to dedup table of srfs_group_info once fully written */
+	struct hlist_node hnode;
+
+	/* Linked to blk_free of srfs_group_info when not allocated */
 	struct list_head list;
 };
 
@@ -96,6 +284,26 @@ typedef struct dir_entry_head
 	uint64_t length;
 }dir_entry_head_t;
 
+/* ino of a removed entry, its slot can be reused by a name up to length bytes */
+#define DIR_ENTRY_FREE 0
+
+/* Size of the whole record, header and name buffer */
+#define DIR_ENTRY_SIZE(eh) (sizeof(dir_entry_head_t) + (eh)->length)
+
+/*
+ * A run of creates in one directory under a single hold of its i_mutex,
+ * see srfs_create_batched
+ */
+struct srfs_create_batch {
+	/* inodes allocated ahead, the next one to use is inodes[next] */
+	struct inode *inodes[SRFS_INODE_BATCH];
+	int nr;
+	int next;
+
+	/* no reusable free record below this directory offset */
+	uint64_t scan;
+};
+
 static inline struct srfs_inode_info *SRFS_INODE(struct inode *inode)
 {
 	return container_of(inode, struct srfs_inode_info, vfs_inode);
@@ -106,6 +314,23 @@ static inline struct srfs_sb_info *SRFS_SB(struct super_block *sb)
 	return sb->s_fs_info;
 }
 
+/*
+ * Take map_sem exclusive to change the block map. A nonblocking
+ * (O_NONBLOCK) caller never sleeps on it and gets -EAGAIN instead.
+ */
+static inline int srfs_map_lock(struct srfs_inode_info *si, bool nowait)
+{
+	if (!nowait) {
+		down_write(&si->map_sem);
+		return 0;
+	}
+
+	return down_write_trylock(&si->map_sem) ? 0 : -EAGAIN;
+}
+
+/* Inode ids and block ids encode their group the same way */
+#define GET_GROUP_BY_BLOCK_ID GET_GROUP_BY_INODE_ID
+
 static inline struct srfs_group_info *GET_GROUP_BY_INODE_ID(
 	struct super_block *sb, uint64_t ino) {	
 	return &(SRFS_SB(sb)->groups[GET_GROUP_INDEX(ino)]);
@@ -1,6 +1,9 @@
 #include <linux/fs.h>
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/gfp.h>
 //#include <linux/stat.h>
 
 #include "ksrfs.h"
@@ -18,36 +21,248 @@ static struct inode *srfs_alloc_inode(struct super_block *sb);
 
 static void srfs_destroy_inode(struct inode *inode);
 
+static void srfs_evict_inode(struct inode *inode);
+
+bool __srfs_put_block(struct srfs_group_info *gi, struct srfs_block_info *bi);
+
+static int srfs_show_options(struct seq_file *m, struct dentry *root);
+
+static int srfs_statfs(struct dentry *dentry, struct kstatfs *buf);
+
 
 const struct super_operations srfs_sb_ops = {
 	.alloc_inode = srfs_alloc_inode,
 	.destroy_inode = srfs_destroy_inode,
+	.evict_inode = srfs_evict_inode,
+	.show_options = srfs_show_options,
+	.statfs = srfs_statfs,
+};
+
+enum {
+	Opt_dedup,
+	Opt_stream,
+	Opt_huge,
+	Opt_groups,
+	Opt_size,
+	Opt_nr_inodes,
+	Opt_err,
 };
 
-static int srfs_group_init(struct srfs_group_info *gi, uint64_t index)
+static const match_table_t srfs_tokens = {
+	{Opt_dedup, "dedup"},
+	{Opt_stream, "stream=%u"},
+	{Opt_huge, "huge"},
+	{Opt_groups, "groups=%u"},
+	{Opt_size, "size=%s"},
+	{Opt_nr_inodes, "nr_inodes=%s"},
+	{Opt_err, NULL},
+};
+
+/*
+ * A number with an optional k, m or g suffix, as tmpfs takes it
+ */
+static int srfs_match_size(substring_t *arg, uint64_t *val)
+{
+	char *str, *rest;
+	int ret = 0;
+
+	str = match_strdup(arg);
+	if (!str) {
+		return -ENOMEM;
+	}
+
+	*val = memparse(str, &rest);
+	if (*rest) {
+		ret = -EINVAL;
+	}
+
+	kfree(str);
+	return ret;
+}
+
+static int srfs_parse_options(char *options, struct srfs_sb_info *sbi)
+{
+	substring_t args[MAX_OPT_ARGS];
+	uint64_t size;
+	char *p;
+	int option;
+
+	if (!options) {
+		return 0;
+	}
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p) {
+			continue;
+		}
+
+		switch (match_token(p, srfs_tokens, args)) {
+		case Opt_dedup:
+			sbi->mount_opt |= SRFS_MOUNT_DEDUP;
+			break;
+		case Opt_stream:
+			if (match_int(&args[0], &option) || option < 0) {
+				return -EINVAL;
+			}
+			sbi->stream_threshold = option;
+			break;
+		case Opt_huge:
+			sbi->mount_opt |= SRFS_MOUNT_HUGE;
+			break;
+		case Opt_groups:
+			if (match_int(&args[0], &option) || option < 1 || option > U8_MAX) {
+				return -EINVAL;
+			}
+			sbi->group_cnt = option;
+			break;
+		case Opt_size:
+			if (srfs_match_size(&args[0], &size)) {
+				return -EINVAL;
+			}
+			sbi->max_blocks = DIV_ROUND_UP(size, SRFS_BLOCK_SIZE);
+			break;
+		case Opt_nr_inodes:
+			if (srfs_match_size(&args[0], &sbi->max_inodes)) {
+				return -EINVAL;
+			}
+			break;
+		default:
+			printk(KERN_ERR "srfs: unrecognized mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int srfs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct srfs_sb_info *sbi = SRFS_SB(root->d_sb);
+
+	if (srfs_test_opt(sbi, DEDUP)) {
+		seq_puts(m, ",dedup");
+	}
+
+	if (srfs_test_opt(sbi, HUGE)) {
+		seq_puts(m, ",huge");
+	}
+
+	if (sbi->group_cnt != SRFS_GROUP_NR) {
+		seq_printf(m, ",groups=%u", sbi->group_cnt);
+	}
+
+	if (sbi->stream_threshold) {
+		seq_printf(m, ",stream=%u", sbi->stream_threshold);
+	}
+
+	if (sbi->max_blocks) {
+		seq_printf(m, ",size=%llu", sbi->max_blocks*SRFS_BLOCK_SIZE);
+	}
+
+	if (sbi->max_inodes) {
+		seq_printf(m, ",nr_inodes=%llu", sbi->max_inodes);
+	}
+
+	return 0;
+}
+
+static int srfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct srfs_sb_info *sbi = SRFS_SB(dentry->d_sb);
+	uint64_t blocks = 0, inodes = 0, used;
+	int i;
+
+	for (i = 0; i < sbi->group_cnt; i++) {
+		blocks += sbi->groups[i].blk_cnt;
+		inodes += sbi->groups[i].ino_cnt;
+	}
+
+	if (sbi->max_blocks) {
+		blocks = min(blocks, sbi->max_blocks);
+	}
+
+	if (sbi->max_inodes) {
+		inodes = min(inodes, sbi->max_inodes);
+	}
+
+	buf->f_type = SRFS_SUPER_MAGIC;
+	buf->f_bsize = SRFS_BLOCK_SIZE;
+	buf->f_namelen = NAME_MAX;
+
+	used = percpu_counter_sum_positive(&sbi->used_blocks);
+	buf->f_blocks = blocks;
+	buf->f_bfree = buf->f_bavail = blocks - min(blocks, used);
+
+	used = percpu_counter_sum_positive(&sbi->used_inodes);
+	buf->f_files = inodes;
+	buf->f_ffree = inodes - min(inodes, used);
+
+	return 0;
+}
+
+/*
+ * Without groups=, enough groups to hold size= and nr_inodes=
+ */
+static uint8_t srfs_groups_needed(struct srfs_sb_info *sbi)
+{
+	uint64_t nr = SRFS_GROUP_NR;
+	uint64_t blk_nr;
+
+	blk_nr = srfs_test_opt(sbi, HUGE) ? PMD_SIZE / SRFS_BLOCK_SIZE : SRFS_GROUP_DATA_BLOCK_NR;
+	nr = max(nr, DIV_ROUND_UP(sbi->max_blocks, blk_nr));
+	nr = max(nr, DIV_ROUND_UP(sbi->max_inodes, (uint64_t)SRFS_GROUP_INODE_NR));
+
+	return min_t(uint64_t, nr, U8_MAX);
+}
+
+/*
+ * The block data of a group lives in its own physically contiguous pages.
+ * With the huge mount option a group holds exactly one PMD sized, PMD
+ * aligned chunk of data, so a file laid out contiguously in it is covered
+ * by a single huge TLB entry in the kernel direct mapping.
+ */
+static int srfs_group_init(struct srfs_group_info *gi, uint64_t index, bool huge)
 {
 	struct srfs_inode_info *si;
 	struct srfs_block_info *bi;
-	char *blk_addr;
 	uint64_t alloc_size;
 	uint64_t i;
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO;
 
 	gi->id = index;
 	gi->ino_cnt = SRFS_GROUP_INODE_NR;
-	gi->blk_cnt = SRFS_GROUP_DATA_BLOCK_NR;
 	gi->blk_size = SRFS_BLOCK_SIZE;
+	if (huge) {
+		gi->blk_cnt = PMD_SIZE / SRFS_BLOCK_SIZE;
+		gi->data_order = get_order(PMD_SIZE);
+		gfp |= __GFP_COMP | __GFP_NOWARN;
+	} else {
+		gi->blk_cnt = SRFS_GROUP_DATA_BLOCK_NR;
+		gi->data_order = get_order(SRFS_GROUP_DATA_BLOCK_NR*SRFS_BLOCK_SIZE);
+	}
 	INIT_LIST_HEAD(&gi->ino_free);
 	INIT_LIST_HEAD(&gi->blk_free);
+	init_llist_head(&gi->ino_rcu_free);
+	gi->ino_avail = gi->ino_cnt;
+	gi->blk_avail = gi->blk_cnt;
+	spin_lock_init(&gi->lock);
+	hash_init(gi->dedup);
 
 	alloc_size = gi->ino_cnt*sizeof(struct srfs_inode_info) + 
-					gi->blk_cnt*sizeof(struct srfs_block_info) +
-					gi->blk_cnt*gi->blk_size;
+					gi->blk_cnt*sizeof(struct srfs_block_info);
 	gi->store = (char *)kzalloc(alloc_size, GFP_KERNEL);
 	if (!gi->store) {
 		return -ENOMEM;
 	}
 
-	printk(KERN_INFO "alloc group store size = %llu, addr = %p\n", alloc_size, gi->store);
+	gi->data = (char *)__get_free_pages(gfp, gi->data_order);
+	if (!gi->data) {
+		printk(KERN_ERR "srfs alloc group data of order %u failed\n", gi->data_order);
+		return -ENOMEM;
+	}
+
+	printk(KERN_INFO "alloc group store size = %llu, addr = %p, data = %p\n",
+					alloc_size, gi->store, gi->data);
 
 	for (i = 0; i < gi->ino_cnt; i++) {
 		si = (struct srfs_inode_info *)gi->store + i;
@@ -56,10 +271,11 @@ static int srfs_group_init(struct srfs_group_info *gi, uint64_t index)
 	}
 
 	bi = (struct srfs_block_info *)(gi->store + gi->ino_cnt*sizeof(struct srfs_inode_info));
-	blk_addr = (char *)(bi + gi->blk_cnt);
+	gi->blk_info = bi;
 	for (i = 0; i < gi->blk_cnt; i++) {
 		bi->id = GENERATE_ID(index, i);
-		bi->addr = blk_addr + i*gi->blk_size;
+		bi->addr = gi->data + i*gi->blk_size;
+		INIT_HLIST_NODE(&bi->hnode);
 		list_add_tail(&bi->list, &gi->blk_free);
 
 		printk(KERN_INFO "bi_addr: %p block[%llu]: %p\n", bi, bi->id, bi->addr);
@@ -70,6 +286,10 @@ static int srfs_group_init(struct srfs_group_info *gi, uint64_t index)
 }
 
 static void srfs_group_exit(struct srfs_group_info *gi) {
+	if (gi->data) {
+		free_pages((unsigned long)gi->data, gi->data_order);
+	}
+
 	if (gi->store) {
 		kfree(gi->store);
 	}
@@ -92,14 +312,33 @@ static int srfs_fill_super(struct super_block *sb, void *data, int silent)
 		goto failed;
 	}
 
-	sbi->group_cnt = SRFS_GROUP_NR;
-	sbi->groups = kzalloc(SRFS_GROUP_NR*sizeof(struct srfs_group_info), GFP_KERNEL);
+	ret = srfs_parse_options(data, sbi);
+	if (ret) {
+		goto failed;
+	}
+
+	if (!sbi->group_cnt) {
+		sbi->group_cnt = srfs_groups_needed(sbi);
+	}
+
+	ret = -ENOMEM;
+	if (percpu_counter_init(&sbi->used_blocks, 0) ||
+		percpu_counter_init(&sbi->used_inodes, 0)) {
+		goto failed;
+	}
+
+	sbi->free_wq = alloc_workqueue("srfs-free", WQ_UNBOUND, 1);
+	if (!sbi->free_wq) {
+		goto failed;
+	}
+
+	sbi->groups = kzalloc(sbi->group_cnt*sizeof(struct srfs_group_info), GFP_KERNEL);
 	if (!sbi->groups) {
 		goto failed;
 	}
 
 	for (; i < sbi->group_cnt; i++) {
-		ret = srfs_group_init(sbi->groups + i, i);
+		ret = srfs_group_init(sbi->groups + i, i, srfs_test_opt(sbi, HUGE));
 		if (ret < 0) {
 			goto failed;
 		}
@@ -117,6 +356,7 @@ static int srfs_fill_super(struct super_block *sb, void *data, int silent)
 	}
 
 	srfs_init_inode(root, NULL, S_IFDIR | S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+	set_nlink(root, 2);
 	sb->s_root = d_make_root(root);
 	if (!sb->s_root) {
 		goto failed;
@@ -138,7 +378,15 @@ static int srfs_fill_super(struct super_block *sb, void *data, int silent)
 
 failed:
 	printk(KERN_ERR "srfs_fill_super failed: %ld\n", ret);
+	sb->s_fs_info = NULL;
 	if (sbi) {
+		if (sbi->free_wq) {
+			destroy_workqueue(sbi->free_wq);
+		}
+
+		percpu_counter_destroy(&sbi->used_blocks);
+		percpu_counter_destroy(&sbi->used_inodes);
+
 		if (sbi->groups) {
 			for (i = 0; i < sbi->group_cnt; i++) {
 				srfs_group_exit(sbi->groups + i);
@@ -160,6 +408,20 @@ void srfs_kill_sb(struct super_block *sb)
 
 	printk(KERN_INFO "srfs_kill_sb\n");
 	sbi = SRFS_SB(sb);
+
+	/* Drop the pinned dentries and evict every inode */
+	kill_litter_super(sb);
+	if (!sbi) {
+		return;
+	}
+
+	/* Wait for background frees and the inodes freed under RCU before the group stores go away */
+	destroy_workqueue(sbi->free_wq);
+	rcu_barrier();
+
+	percpu_counter_destroy(&sbi->used_blocks);
+	percpu_counter_destroy(&sbi->used_inodes);
+
 	for (; i < sbi->group_cnt; i++) {
 		srfs_group_exit(sbi->groups + i);
 	}
@@ -177,27 +439,41 @@ struct dentry* srfs_mount(struct file_system_type *fs_type,
 	return mount_nodev(fs_type, flags, data, srfs_fill_super);
 }
 
-static struct inode *srfs_alloc_inode(struct super_block *sb)
+/*
+ * Account nr objects against a limit without a global lock. Like tmpfs,
+ * percpu_counter_compare only sums up the per-cpu counts when the mount is
+ * close to its limit, concurrent reservations may overshoot it slightly.
+ */
+static int srfs_reserve(struct percpu_counter *used, uint64_t max, uint64_t nr)
 {
-	struct srfs_sb_info *sbi;
-	struct srfs_inode_info *si;
-	struct srfs_group_info *gi;
+	if (max && (nr > max || percpu_counter_compare(used, max - nr) > 0)) {
+		return -ENOSPC;
+	}
 
-	sbi = SRFS_SB(sb);
-	sbi->last_group = (++sbi->last_group == SRFS_GROUP_NR) ? 0 : sbi->last_group;
-	gi = &(sbi->groups[sbi->last_group]);
+	percpu_counter_add(used, nr);
+	return 0;
+}
 
-	if (list_empty(&gi->ino_free)) {
-		printk(KERN_WARNING "srfs allocate inode failed: inode resource exausted!\n");
-		return NULL;
-	}
+int srfs_reserve_blocks(struct super_block *sb, uint64_t nr)
+{
+	struct srfs_sb_info *sbi = SRFS_SB(sb);
 
-	si = list_first_entry(&gi->ino_free, 
-							struct srfs_inode_info, 
-							list);
-	list_del(&si->list);
+	return srfs_reserve(&sbi->used_blocks, sbi->max_blocks, nr);
+}
+
+void srfs_release_blocks(struct super_block *sb, uint64_t nr)
+{
+	percpu_counter_sub(&SRFS_SB(sb)->used_blocks, nr);
+}
+
+static void srfs_reset_inode(struct srfs_inode_info *si)
+{
 	si->size = 0;
-	INIT_LIST_HEAD(&si->data);
+	si->blk_cnt = 0;
+	si->blk_cap = 0;
+	si->blocks = NULL;
+	si->link = NULL;
+	init_rwsem(&si->map_sem);
 
 	/*
 	 * The vfs inode is part of the srfs_inode_info, so its memory allocation is the responsibility of 
@@ -207,54 +483,627 @@ static struct inode *srfs_alloc_inode(struct super_block *sb)
 	 * therefore, it's necessary to invoke this init once procedure here for alternative.
 	*/
 	inode_init_once(&si->vfs_inode);
+}
+
+/*
+ * Move the inodes freed under RCU back to the free list, gi->lock must be held
+ */
+static void __srfs_drain_rcu_free(struct srfs_group_info *gi)
+{
+	struct llist_node *node = llist_del_all(&gi->ino_rcu_free);
+	struct srfs_inode_info *si;
+
+	while (node) {
+		si = llist_entry(node, struct srfs_inode_info, rcu_free);
+		node = node->next;
+		list_add_tail(&si->list, &gi->ino_free);
+		gi->ino_avail++;
+	}
+}
+
+/*
+ * Take up to nr free inode slots of the group under a single lock hold
+ */
+static int srfs_take_inodes(struct srfs_group_info *gi,
+							struct srfs_inode_info **sis, int nr)
+{
+	int i, got = 0;
+
+	spin_lock(&gi->lock);
+	__srfs_drain_rcu_free(gi);
+	while (got < nr && !list_empty(&gi->ino_free)) {
+		sis[got] = list_first_entry(&gi->ino_free, 
+							struct srfs_inode_info, 
+							list);
+		list_del(&sis[got]->list);
+		got++;
+	}
+	gi->ino_avail -= got;
+	spin_unlock(&gi->lock);
+
+	for (i = 0; i < got; i++) {
+		srfs_reset_inode(sis[i]);
+	}
+
+	return got;
+}
+
+/*
+ * Take a free inode slot of the group
+ */
+static struct srfs_inode_info *srfs_take_inode(struct srfs_group_info *gi)
+{
+	struct srfs_inode_info *si;
+
+	return srfs_take_inodes(gi, &si, 1) ? si : NULL;
+}
+
+static void srfs_return_inode(struct srfs_group_info *gi, struct srfs_inode_info *si)
+{
+	spin_lock(&gi->lock);
+	list_add_tail(&si->list, &gi->ino_free);
+	gi->ino_avail++;
+	spin_unlock(&gi->lock);
+}
+
+/*
+ * Without a parent to place it next to, spread inodes round robin
+ */
+static struct srfs_inode_info *__srfs_alloc_inode(struct srfs_sb_info *sbi)
+{
+	struct srfs_inode_info *si;
+	int i, g;
+
+	g = ACCESS_ONCE(sbi->last_group);
+	for (i = 0; i < sbi->group_cnt; i++) {
+		g = (g + 1) % sbi->group_cnt;
+		ACCESS_ONCE(sbi->last_group) = g;
+		si = srfs_take_inode(&sbi->groups[g]);
+		if (si) {
+			return si;
+		}
+	}
+
+	printk(KERN_WARNING "srfs allocate inode failed: inode resource exausted!\n");
+	return NULL;
+}
+
+static struct inode *srfs_alloc_inode(struct super_block *sb)
+{
+	struct srfs_sb_info *sbi = SRFS_SB(sb);
+	struct srfs_inode_info *si;
+
+	if (srfs_reserve(&sbi->used_inodes, sbi->max_inodes, 1)) {
+		return NULL;
+	}
+
+	si = __srfs_alloc_inode(sbi);
+	if (!si) {
+		percpu_counter_dec(&sbi->used_inodes);
+		return NULL;
+	}
 
 	return &si->vfs_inode;
 }
 
 /*
+ * Orlov style placement. Top level directories go to the group with the
+ * most free blocks so unrelated trees spread out, everything else stays
+ * in the group of its parent while that group has inodes and blocks left,
+ * then moves on to the following groups.
+ */
+static struct srfs_group_info *srfs_find_group(struct inode *dir, umode_t mode)
+{
+	struct srfs_sb_info *sbi = SRFS_SB(dir->i_sb);
+	struct srfs_group_info *gi, *best = NULL;
+	int i, start;
+
+	start = GET_GROUP_INDEX(dir->i_ino);
+	if (S_ISDIR(mode) && dir == dir->i_sb->s_root->d_inode) {
+		start = (ACCESS_ONCE(sbi->last_group) + 1) % sbi->group_cnt;
+		ACCESS_ONCE(sbi->last_group) = start;
+		for (i = 0; i < sbi->group_cnt; i++) {
+			gi = &sbi->groups[(start + i) % sbi->group_cnt];
+			if (gi->ino_avail && (!best || gi->blk_avail > best->blk_avail)) {
+				best = gi;
+			}
+		}
+
+		return best;
+	}
+
+	for (i = 0; i < sbi->group_cnt; i++) {
+		gi = &sbi->groups[(start + i) % sbi->group_cnt];
+		if (gi->ino_avail && gi->blk_avail) {
+			return gi;
+		}
+	}
+
+	/* Out of blocks everywhere, any free inode will do */
+	for (i = 0; i < sbi->group_cnt; i++) {
+		gi = &sbi->groups[(start + i) % sbi->group_cnt];
+		if (gi->ino_avail) {
+			return gi;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * new_inode() for srfs: like it, but the inodes are taken from the group
+ * srfs_find_group picks for children of dir. Up to nr (at most
+ * SRFS_INODE_BATCH) inodes are reserved and taken from the group at once,
+ * returns how many were allocated.
+ */
+int srfs_new_inodes(struct inode *dir, umode_t mode, struct inode **inodes, int nr)
+{
+	struct super_block *sb = dir->i_sb;
+	struct srfs_sb_info *sbi = SRFS_SB(sb);
+	struct srfs_inode_info *sis[SRFS_INODE_BATCH];
+	struct srfs_group_info *gi;
+	struct srfs_inode_info *si;
+	struct inode *inode;
+	int i, got = 0, ret = 0;
+
+	nr = min(nr, SRFS_INODE_BATCH);
+	if (srfs_reserve(&sbi->used_inodes, sbi->max_inodes, nr)) {
+		/* Close to the limit a single inode may still fit */
+		if (nr == 1 || srfs_reserve(&sbi->used_inodes, sbi->max_inodes, 1)) {
+			return 0;
+		}
+		nr = 1;
+	}
+
+	gi = srfs_find_group(dir, mode);
+	if (gi) {
+		got = srfs_take_inodes(gi, sis, nr);
+	}
+
+	/* lost a race for the last inodes of the group */
+	while (got < nr) {
+		si = __srfs_alloc_inode(sbi);
+		if (!si) {
+			break;
+		}
+		sis[got++] = si;
+	}
+
+	for (i = 0; i < got; i++) {
+		inode = &sis[i]->vfs_inode;
+		if (unlikely(inode_init_always(sb, inode))) {
+			srfs_return_inode(GET_GROUP_BY_INODE_ID(sb, sis[i]->id), sis[i]);
+			continue;
+		}
+
+		inode->i_state = 0;
+		INIT_LIST_HEAD(&inode->i_sb_list);
+		inode_sb_list_add(inode);
+		inodes[ret++] = inode;
+	}
+
+	if (ret < nr) {
+		percpu_counter_sub(&sbi->used_inodes, nr - ret);
+	}
+
+	return ret;
+}
+
+struct inode *srfs_new_inode(struct inode *dir, umode_t mode)
+{
+	struct inode *inode;
+
+	return srfs_new_inodes(dir, mode, &inode, 1) ? inode : NULL;
+}
+
+/*
+ * Runs in softirq context, where neither gi->lock nor the percpu counters
+ * may be taken. The inode is queued lock-free for the next srfs_take_inodes.
+ */
 static void srfs_i_callback(struct rcu_head *head)
 {
 	struct inode *inode = container_of(head, struct inode, i_rcu);
-	struct srfs_inode_info *si = SRFS_INDOE(inode);
+	struct srfs_inode_info *si = SRFS_INODE(inode);
 
-	struct srfs_group_info *gi = GET_GROUP_FROM_VFS_INODE(inode);
-	list_add_tail(&si->list, &gi->ino_free);
+	llist_add(&si->rcu_free, &GET_GROUP_BY_INODE_ID(inode->i_sb, si->id)->ino_rcu_free);
 }
-*/
 
+/*
+ * Only unlinked inodes are returned to the free list, after a grace period
+ * since RCU path walks may still be looking at them. The reservation is
+ * dropped here, in process context.
+ */
 static void srfs_destroy_inode(struct inode *inode)
 {
-	//call_rcu(&inode->i_rcu, srfs_i_callback);
+	if (inode->i_nlink) {
+		return;
+	}
+
+	percpu_counter_dec(&SRFS_SB(inode->i_sb)->used_inodes);
+	call_rcu(&inode->i_rcu, srfs_i_callback);
 }
 
-struct srfs_block_info *srfs_alloc_block(struct super_block *sb, struct inode *inode)
+/*
+ * Drop one reference of each block. Runs of blocks of one group are put
+ * under a single lock hold of at most SRFS_FREE_BATCH blocks, so concurrent
+ * allocators are never held off for long.
+ */
+static void srfs_put_blocks(struct super_block *sb,
+							struct srfs_block_info **blocks,
+							uint64_t nr)
 {
-	struct srfs_group_info *gi;
-	struct srfs_block_info *bi;
-	struct srfs_inode_info *si;
+	struct srfs_group_info *gi = NULL, *bgi;
+	uint64_t i, batch = 0, freed = 0;
 
-	gi = GET_GROUP_BY_INODE_ID(sb, inode->i_ino);
-	if (unlikely(!gi)) {
-		printk(KERN_ERR "Can't find group info for this inode: %ld\n", (long)inode->i_ino);
-		return NULL;
+	for (i = 0; i < nr; i++) {
+		bgi = GET_GROUP_BY_BLOCK_ID(sb, blocks[i]->id);
+		if (bgi != gi || batch == SRFS_FREE_BATCH) {
+			if (gi) {
+				spin_unlock(&gi->lock);
+				cond_resched();
+			}
+			gi = bgi;
+			batch = 0;
+			spin_lock(&gi->lock);
+		}
+		batch++;
+
+		if (__srfs_put_block(gi, blocks[i])) {
+			freed++;
+		}
 	}
-	
+
+	if (gi) {
+		spin_unlock(&gi->lock);
+	}
+
+	srfs_release_blocks(sb, freed);
+}
+
+struct srfs_free_work {
+	struct work_struct work;
+	struct super_block *sb;
+	struct srfs_block_info **blocks;
+	uint64_t blk_cnt;
+};
+
+static void srfs_free_worker(struct work_struct *work)
+{
+	struct srfs_free_work *fw = container_of(work, struct srfs_free_work, work);
+
+	printk(KERN_INFO "srfs background free of %llu blocks\n", fw->blk_cnt);
+	srfs_put_blocks(fw->sb, fw->blocks, fw->blk_cnt);
+	kfree(fw->blocks);
+	kfree(fw);
+}
+
+/*
+ * Drop all data blocks of the inode. The block map of a large file is
+ * handed over to the background workqueue, so the caller doesn't wait
+ * for every block to be returned to its group.
+ */
+void srfs_free_inode_blocks(struct inode *inode)
+{
+	struct srfs_inode_info *si = SRFS_INODE(inode);
+	struct srfs_free_work *fw = NULL;
+
+	if (si->blk_cnt > SRFS_ASYNC_FREE_BLOCKS) {
+		fw = kmalloc(sizeof(*fw), GFP_NOFS);
+	}
+
+	if (fw) {
+		INIT_WORK(&fw->work, srfs_free_worker);
+		fw->sb = inode->i_sb;
+		fw->blocks = si->blocks;
+		fw->blk_cnt = si->blk_cnt;
+		queue_work(SRFS_SB(inode->i_sb)->free_wq, &fw->work);
+	} else {
+		srfs_put_blocks(inode->i_sb, si->blocks, si->blk_cnt);
+		kfree(si->blocks);
+	}
+
+	si->blocks = NULL;
+	si->blk_cnt = 0;
+	si->blk_cap = 0;
+	si->size = 0;
+}
+
+static void srfs_evict_inode(struct inode *inode)
+{
+	truncate_inode_pages(&inode->i_data, 0);
+	clear_inode(inode);
+
+	if (!inode->i_nlink) {
+		printk(KERN_INFO "srfs free inode %lu\n", inode->i_ino);
+		srfs_free_inode_blocks(inode);
+	} else {
+		/* Linked inodes are pinned until umount, their blocks go with the group stores */
+		kfree(SRFS_INODE(inode)->blocks);
+		SRFS_INODE(inode)->blocks = NULL;
+	}
+}
+
+/*
+ * Take a block off the free list of the group, gi->lock must be held
+ */
+struct srfs_block_info *__srfs_get_free_block(struct srfs_group_info *gi)
+{
+	struct srfs_block_info *bi;
+
 	if (list_empty(&gi->blk_free)) {
 		printk(KERN_WARNING "srfs allocate block failed: block exausted!\n");
 		return NULL;
 	}
 
-	printk(KERN_INFO "ready to allocate\n");
-
-	si = SRFS_INODE(inode);
 	bi = list_first_entry(&gi->blk_free,
 							struct srfs_block_info,
 							list);
 	list_del(&bi->list);
-	list_add_tail(&bi->list, &si->data);
-	si->blk_cnt++;
+	bi->refcnt = 1;
+	gi->blk_avail--;
 
 	return bi;
 }
 
+/*
+ * Take the block physically following the last block of the file if it is
+ * free, so files written sequentially end up in contiguous extents.
+ * gi->lock must be held.
+ */
+static struct srfs_block_info *__srfs_get_next_block(struct srfs_group_info *gi,
+							struct srfs_inode_info *si)
+{
+	struct srfs_block_info *bi;
+
+	if (si->blk_cnt == 0) {
+		return NULL;
+	}
+
+	bi = si->blocks[si->blk_cnt - 1] + 1;
+	if (bi < gi->blk_info || bi >= gi->blk_info + gi->blk_cnt || bi->refcnt || bi->pins) {
+		return NULL;
+	}
+
+	list_del(&bi->list);
+	bi->refcnt = 1;
+	gi->blk_avail--;
+
+	return bi;
+}
+
+/*
+ * Drop one reference of the block, gi->lock must be held.
+ * Returns true if that was the last one and the block is free again.
+ */
+bool __srfs_put_block(struct srfs_group_info *gi, struct srfs_block_info *bi)
+{
+	BUG_ON(bi->refcnt == 0);
+
+	if (--bi->refcnt) {
+		return false;
+	}
+
+	if (!hlist_unhashed(&bi->hnode)) {
+		hash_del(&bi->hnode);
+	}
+
+	/* A reader still copies from it, srfs_unpin_block frees it */
+	if (bi->pins) {
+		return false;
+	}
 
+	list_add(&bi->list, &gi->blk_free);
+	gi->blk_avail++;
+
+	return true;
+}
+
+/*
+ * Drop a pin taken by srfs_pin_block. A block no file references anymore
+ * goes back to the free list with its last pin.
+ */
+void srfs_unpin_block(struct super_block *sb, struct srfs_block_info *bi)
+{
+	struct srfs_group_info *gi = GET_GROUP_BY_BLOCK_ID(sb, bi->id);
+	bool freed = false;
+
+	spin_lock(&gi->lock);
+	BUG_ON(bi->pins == 0);
+	if (--bi->pins == 0 && bi->refcnt == 0) {
+		list_add(&bi->list, &gi->blk_free);
+		gi->blk_avail++;
+		freed = true;
+	}
+	spin_unlock(&gi->lock);
+
+	if (freed) {
+		srfs_release_blocks(sb, 1);
+	}
+}
+
+/*
+ * Make sure the block map of the inode has room for nr more blocks
+ */
+static int srfs_grow_block_map(struct srfs_inode_info *si, uint64_t nr, gfp_t gfp)
+{
+	struct srfs_block_info **blocks;
+	uint64_t cap;
+
+	if (si->blk_cnt + nr <= si->blk_cap) {
+		return 0;
+	}
+
+	cap = si->blk_cap ? si->blk_cap*2 : 4;
+	while (cap < si->blk_cnt + nr) {
+		cap *= 2;
+	}
+
+	blocks = krealloc(si->blocks, cap*sizeof(*blocks), gfp);
+	if (!blocks) {
+		return -ENOMEM;
+	}
+
+	si->blocks = blocks;
+	si->blk_cap = cap;
+
+	return 0;
+}
+
+/*
+ * Append nr blocks to the inode under a single lock hold. Blocks allocated
+ * before the group runs out are kept by the inode. A nonblocking caller
+ * gets -EAGAIN where it would have to sleep, on map_sem or for memory to
+ * grow the block map; both are transient, so a retry can make progress.
+ */
+int srfs_alloc_blocks(struct super_block *sb, struct inode *inode, uint64_t nr, bool nowait)
+{
+	struct srfs_sb_info *sbi;
+	struct srfs_group_info *gi;
+	struct srfs_block_info *bi;
+	struct srfs_inode_info *si;
+	uint64_t first, i;
+	int g, start, ret;
+
+	sbi = SRFS_SB(sb);
+	si = SRFS_INODE(inode);
+
+	/* A full mount fails here, before any group lock is taken */
+	if (srfs_reserve_blocks(sb, nr)) {
+		return -ENOSPC;
+	}
+
+	ret = srfs_map_lock(si, nowait);
+	if (ret) {
+		srfs_release_blocks(sb, nr);
+		return ret;
+	}
+
+	if (srfs_grow_block_map(si, nr, nowait ? GFP_NOWAIT : GFP_KERNEL)) {
+		up_write(&si->map_sem);
+		printk(KERN_WARNING "srfs grow block map failed\n");
+		srfs_release_blocks(sb, nr);
+		return nowait ? -EAGAIN : -ENOMEM;
+	}
+
+	/* Blocks come from the group of the inode first, then the following ones */
+	first = si->blk_cnt;
+	start = GET_GROUP_INDEX(inode->i_ino);
+	for (g = 0; g < sbi->group_cnt && si->blk_cnt - first < nr; g++) {
+		gi = &sbi->groups[(start + g) % sbi->group_cnt];
+		if (!gi->blk_avail) {
+			continue;
+		}
+
+		spin_lock(&gi->lock);
+		while (si->blk_cnt - first < nr) {
+			bi = __srfs_get_next_block(gi, si);
+			if (!bi) {
+				bi = __srfs_get_free_block(gi);
+			}
+			if (!bi) {
+				break;
+			}
+			si->blocks[si->blk_cnt++] = bi;
+		}
+		spin_unlock(&gi->lock);
+	}
+
+	/* Blocks are recycled, don't leak the data of a removed file */
+	for (i = first; i < si->blk_cnt; i++) {
+		memset(si->blocks[i]->addr, 0, SRFS_BLOCK_SIZE);
+	}
+	up_write(&si->map_sem);
+
+	srfs_release_blocks(sb, nr - (si->blk_cnt - first));
+
+	return (si->blk_cnt - first == nr) ? 0 : -ENOSPC;
+}
+
+/*
+ * Take a single free block for the inode, from the group of the inode
+ * first, then the following ones. The caller has reserved it.
+ */
+struct srfs_block_info *srfs_get_free_block(struct super_block *sb, struct inode *inode)
+{
+	struct srfs_sb_info *sbi = SRFS_SB(sb);
+	struct srfs_group_info *gi;
+	struct srfs_block_info *bi = NULL;
+	int g, start;
+
+	start = GET_GROUP_INDEX(inode->i_ino);
+	for (g = 0; g < sbi->group_cnt && !bi; g++) {
+		gi = &sbi->groups[(start + g) % sbi->group_cnt];
+		if (!gi->blk_avail) {
+			continue;
+		}
+
+		spin_lock(&gi->lock);
+		bi = __srfs_get_free_block(gi);
+		spin_unlock(&gi->lock);
+	}
+
+	return bi;
+}
+
+struct srfs_block_info *srfs_alloc_block(struct super_block *sb, struct inode *inode)
+{
+	struct srfs_inode_info *si = SRFS_INODE(inode);
+
+	if (srfs_alloc_blocks(sb, inode, 1, false)) {
+		return NULL;
+	}
+
+	return si->blocks[si->blk_cnt - 1];
+}
+
+/*
+ * Make dst reference every data block of src. The blocks are copied on the
+ * next write to either file, see srfs_cow_block.
+ */
+int srfs_share_blocks(struct inode *dst, struct inode *src)
+{
+	struct srfs_inode_info *dsi, *ssi;
+	struct srfs_group_info *gi = NULL, *bgi;
+	struct srfs_block_info *bi;
+	uint64_t i;
+
+	dsi = SRFS_INODE(dst);
+	ssi = SRFS_INODE(src);
+	if (ssi->blk_cnt == 0) {
+		return 0;
+	}
+
+	down_write(&dsi->map_sem);
+	dsi->blocks = kmalloc(ssi->blk_cnt*sizeof(*dsi->blocks), GFP_KERNEL);
+	if (!dsi->blocks) {
+		up_write(&dsi->map_sem);
+		return -ENOMEM;
+	}
+	dsi->blk_cap = ssi->blk_cnt;
+
+	for (i = 0; i < ssi->blk_cnt; i++) {
+		bi = ssi->blocks[i];
+		bgi = GET_GROUP_BY_BLOCK_ID(src->i_sb, bi->id);
+
+		/* Runs of blocks of one group are taken under a single lock hold */
+		if (bgi != gi || (i & 1023) == 0) {
+			if (gi) {
+				spin_unlock(&gi->lock);
+				cond_resched();
+			}
+			gi = bgi;
+			spin_lock(&gi->lock);
+		}
+
+		bi->refcnt++;
+		dsi->blocks[i] = bi;
+	}
+	spin_unlock(&gi->lock);
+
+	dsi->blk_cnt = ssi->blk_cnt;
+	dsi->size = ssi->size;
+	dst->i_size = src->i_size;
+	up_write(&dsi->map_sem);
+
+	return 0;
+}
@@ -1,8 +1,21 @@
 #!/bin/bash
 
 MODULE_NAME=srfs
-MOUNT_POINT=/mnt/srfs
-MODULE_SRC=/root/srfs
+MOUNT_POINT=${MOUNT_POINT:-/mnt/srfs}
+MODULE_SRC=${MODULE_SRC:-$(cd "$(dirname "$0")" && pwd)}
+MOUNT_OPTS=${MOUNT_OPTS:-}
+
+# number of concurrent writers / files created by the stress part
+WRITERS=${WRITERS:-4}
+
+# throughput and p99 latency of the workloads are recorded here and later
+# runs are compared with them, UPDATE_BASELINE=1 records the new results
+BASELINE=${BASELINE:-$MODULE_SRC/.test_baseline}
+
+fail() {
+	echo "FAIL: $*"
+	exit 1
+}
 
 # create mount point
 if [[ ! -d "$MOUNT_POINT" ]]; then
@@ -10,10 +23,12 @@ if [[ ! -d "$MOUNT_POINT" ]]; then
 		{ echo "mkdir -p $MOUNT_POINT failed"; exit 1; }
 fi
 
-# recompile the module
+# recompile the module, unless it was built outside (see vm-test.sh)
 cd $MODULE_SRC || { echo "cd $MODULE_SRC failed"; exit 1; }
-make clean || exit 2
-make || exit 2
+if [[ -z "$SKIP_BUILD" ]]; then
+	make clean || exit 2
+	make || exit 2
+fi
 
 # umount the fs
 mount | grep $MOUNT_POINT > /dev/null 2>&1
@@ -29,11 +44,132 @@ if [ $? = 0 ]; then
         { echo "rmmod $MODULE_NAME failed";exit 1; }
 fi
 
+# helpers issuing the srfs ioctls and the workload driver
+CHECK=${CHECK:-$MODULE_SRC/tools/srfs_check}
+BENCH=${BENCH:-$MODULE_SRC/tools/srfs_bench}
+if [[ -z "$SKIP_BUILD" || ! -x "$CHECK" || ! -x "$BENCH" ]]; then
+	cc -O2 -o $CHECK $MODULE_SRC/tools/srfs_check.c || exit 2
+	cc -O2 -pthread -o $BENCH $MODULE_SRC/tools/srfs_bench.c || exit 2
+fi
+
 # reinstall the kernel module
+modprobe libcrc32c > /dev/null 2>&1
 insmod $MODULE_NAME.ko || exit 1
-mount -t $MODULE_NAME "fan" $MOUNT_POINT || exit 1
+mount -t $MODULE_NAME ${MOUNT_OPTS:+-o $MOUNT_OPTS} "fan" $MOUNT_POINT || exit 1
+
+# extents of a sequential file and of a clone, while the blocks are still
+# handed out in order on the fresh mount
+$CHECK $MOUNT_POINT extents || fail "extent reporting"
 
 # ftruncate test block
 TEST_FILE=$MOUNT_POINT/file1
 touch $TEST_FILE || { echo "touch file $TEST_FILE failed"; exit 1; }
 echo "1234567890" >> $TEST_FILE || { echo "write file $TEST_FILE failed"; exit 1; }
+
+# read back what was appended
+[ "$(cat $TEST_FILE)" = "1234567890" ] || fail "read back $TEST_FILE"
+
+# consecutive writes through one descriptor must not overwrite each other
+printf 'abc' > $MOUNT_POINT/file2 && printf 'def' >> $MOUNT_POINT/file2 || fail "write file2"
+[ "$(cat $MOUNT_POINT/file2)" = "abcdef" ] || fail "append file2"
+
+# directories, rename and unlink
+mkdir $MOUNT_POINT/dir1 || fail "mkdir dir1"
+mv $MOUNT_POINT/file2 $MOUNT_POINT/dir1/file2 || fail "rename into dir1"
+[ "$(cat $MOUNT_POINT/dir1/file2)" = "abcdef" ] || fail "read renamed file2"
+echo "new" > $MOUNT_POINT/file3 && mv $MOUNT_POINT/file3 $MOUNT_POINT/dir1/file2 || fail "rename over file2"
+[ "$(cat $MOUNT_POINT/dir1/file2)" = "new" ] || fail "read replaced file2"
+rmdir $MOUNT_POINT/dir1 2> /dev/null && fail "rmdir of a non empty directory"
+rm $MOUNT_POINT/dir1/file2 && rmdir $MOUNT_POINT/dir1 || fail "remove dir1"
+
+# symlinks, inline and block backed, and hard links
+echo "target" > $MOUNT_POINT/file4 || fail "write file4"
+ln -s file4 $MOUNT_POINT/short || fail "symlink short"
+[ "$(cat $MOUNT_POINT/short)" = "target" ] || fail "follow short symlink"
+long=$(printf 'd%.0s' $(seq 200))
+ln -s $long $MOUNT_POINT/long || fail "symlink long"
+[ "$(readlink $MOUNT_POINT/long)" = "$long" ] || fail "readlink long symlink"
+ln $MOUNT_POINT/file4 $MOUNT_POINT/file4.link || fail "hard link file4"
+[ $(stat -c %h $MOUNT_POINT/file4) = 2 ] || fail "link count of file4"
+rm $MOUNT_POINT/file4 && [ "$(cat $MOUNT_POINT/file4.link)" = "target" ] || fail "read hard link"
+rm $MOUNT_POINT/short $MOUNT_POINT/long $MOUNT_POINT/file4.link || fail "remove links"
+
+# copy-on-write clones of a file and a tree through SRFS_IOC_CLONE
+$CHECK $MOUNT_POINT clone || fail "clone ioctl"
+
+# bulk creation through SRFS_IOC_POPULATE, including its failure modes
+$CHECK $MOUNT_POINT populate || fail "populate ioctl"
+
+# concurrent writers, each appending to its own file
+for i in $(seq $WRITERS); do
+	( for j in $(seq 16); do echo "writer $i line $j" >> $MOUNT_POINT/w$i; done ) &
+done
+wait
+for i in $(seq $WRITERS); do
+	[ $(wc -l < $MOUNT_POINT/w$i) = 16 ] || fail "concurrent writer $i"
+	rm $MOUNT_POINT/w$i || fail "rm w$i"
+done
+
+# directory growth until the directory block is full
+i=0
+while touch $MOUNT_POINT/entry_$i 2> /dev/null; do
+	i=$((i + 1))
+done
+[ $i -gt 0 ] || fail "no directory entry created"
+echo "directory full after $i entries"
+rm -f $MOUNT_POINT/entry_* || fail "rm entries"
+touch $MOUNT_POINT/entry_again || fail "reuse removed directory entries"
+rm $MOUNT_POINT/entry_again
+
+# allocator exhaustion, then everything must be given back on unlink
+dd if=/dev/zero of=$MOUNT_POINT/big bs=1k count=1M 2> /dev/null
+size=$(stat -c %s $MOUNT_POINT/big)
+[ $size -gt 0 ] || fail "large file is empty"
+echo "large file stopped at $size bytes"
+rm $MOUNT_POINT/big || fail "rm big"
+dd if=/dev/zero of=$MOUNT_POINT/big bs=1k count=1M 2> /dev/null
+[ $(stat -c %s $MOUNT_POINT/big) = $size ] || fail "blocks leaked by unlink"
+rm $MOUNT_POINT/big
+
+# statfs reports the space given back
+free=$(stat -f -c %f $MOUNT_POINT)
+[ $free -gt 0 ] && [ $free -le $(stat -f -c %b $MOUNT_POINT) ] || fail "statfs free blocks"
+
+# multi-threaded data and metadata workloads, compared with the baseline
+regressed=0
+declare -A base_rate base_p99
+if [ -f "$BASELINE" ]; then
+	while read name rate p50 p99; do
+		base_rate[$name]=$rate
+		base_p99[$name]=$p99
+	done < $BASELINE
+fi
+
+results=""
+for workload in data meta; do
+	out=$($BENCH $MOUNT_POINT $workload -t $WRITERS -d ${BENCH_SECONDS:-5}) || fail "$workload workload"
+	echo "$out" | grep -v '^RESULT'
+	set -- $(echo "$out" | grep '^RESULT')
+	name=$2 rate=$3 p50=$4 p99=$5
+	results+="$name $rate $p50 $p99"$'\n'
+
+	# slower by more than 10%, or a p99 latency up by more than half
+	if [[ -n "${base_rate[$name]}" ]]; then
+		if [ $rate -lt $(( ${base_rate[$name]} * 9 / 10 )) ]; then
+			echo "REGRESSION: $name $rate ops/s, baseline ${base_rate[$name]} ops/s"
+			regressed=1
+		fi
+		if [ $p99 -gt $(( ${base_p99[$name]} * 3 / 2 )) ]; then
+			echo "REGRESSION: $name p99 ${p99}ns, baseline ${base_p99[$name]}ns"
+			regressed=1
+		fi
+	fi
+done
+
+if [[ ! -f "$BASELINE" || -n "$UPDATE_BASELINE" ]]; then
+	printf "%s" "$results" > $BASELINE
+fi
+
+[ $regressed = 0 ] || exit 3
+
+echo "PASS"
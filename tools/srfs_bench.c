@@ -0,0 +1,258 @@
+/*
+ * Multi-threaded workload driver for test.sh.
+ *
+ *   srfs_bench <dir> data|meta [-t threads] [-d seconds] [-b bs] [-s size]
+ *
+ * data: every thread owns one file and alternates pwrite/pread of bs bytes
+ *       at block aligned offsets below size, each syscall is one sample.
+ * meta: every thread owns one directory and runs create/write/stat/unlink
+ *       rounds of a small file, each round is one sample.
+ *
+ * Prints a human readable summary and a line
+ *   RESULT <workload> <ops per second> <p50 ns> <p99 ns>
+ * for the script to compare against its baseline.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+struct worker {
+	pthread_t thread;
+	int id;
+	uint64_t *lat;
+	uint64_t nr;
+	uint64_t cap;
+	int err;
+};
+
+static const char *dir;
+static int meta;
+static int duration = 5;
+static size_t bs = 1024;
+static size_t size = 2048;
+static volatile int stop;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static int record(struct worker *w, uint64_t start)
+{
+	uint64_t *lat;
+
+	if (w->nr == w->cap) {
+		w->cap = w->cap ? w->cap*2 : 65536;
+		lat = realloc(w->lat, w->cap*sizeof(*lat));
+		if (!lat) {
+			return -ENOMEM;
+		}
+		w->lat = lat;
+	}
+
+	w->lat[w->nr++] = now_ns() - start;
+	return 0;
+}
+
+static int data_loop(struct worker *w)
+{
+	char path[4096];
+	char *buf;
+	uint64_t i, start;
+	off_t off;
+	ssize_t ret;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/data.%d", dir, w->id);
+	fd = open(path, O_CREAT | O_RDWR, 0644);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	buf = malloc(bs);
+	if (!buf) {
+		close(fd);
+		return -ENOMEM;
+	}
+	memset(buf, 'a' + w->id % 26, bs);
+
+	for (i = 0; !stop; i++) {
+		off = (off_t)((i/2) % (size/bs))*bs;
+		start = now_ns();
+		if (i & 1) {
+			ret = pread(fd, buf, bs, off);
+		} else {
+			ret = pwrite(fd, buf, bs, off);
+		}
+		if (ret != (ssize_t)bs) {
+			ret = ret < 0 ? -errno : -EIO;
+			break;
+		}
+		ret = record(w, start);
+		if (ret) {
+			break;
+		}
+	}
+
+	free(buf);
+	close(fd);
+	unlink(path);
+	return stop ? 0 : (int)ret;
+}
+
+static int meta_loop(struct worker *w)
+{
+	char sub[4096], path[4096 + 32];
+	struct stat st;
+	uint64_t i, start;
+	int fd, ret = 0;
+
+	snprintf(sub, sizeof(sub), "%s/meta.%d", dir, w->id);
+	if (mkdir(sub, 0755) && errno != EEXIST) {
+		return -errno;
+	}
+
+	for (i = 0; !stop; i++) {
+		snprintf(path, sizeof(path), "%s/f%llu", sub, (unsigned long long)(i % 8));
+		start = now_ns();
+		fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+		if (fd < 0 || write(fd, "0123456789abcdef", 16) != 16 ||
+			fstat(fd, &st) || close(fd) || unlink(path)) {
+			ret = -errno;
+			break;
+		}
+		ret = record(w, start);
+		if (ret) {
+			break;
+		}
+	}
+
+	rmdir(sub);
+	return ret;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+
+	w->err = meta ? meta_loop(w) : data_loop(w);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s <dir> data|meta [-t threads] [-d seconds] [-b bs] [-s size]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	uint64_t *all, total = 0, n = 0;
+	uint64_t start, elapsed;
+	int threads = 4;
+	int i, opt, err = 0;
+
+	if (argc < 3) {
+		usage(argv[0]);
+	}
+
+	dir = argv[1];
+	if (!strcmp(argv[2], "meta")) {
+		meta = 1;
+	} else if (strcmp(argv[2], "data")) {
+		usage(argv[0]);
+	}
+
+	optind = 3;
+	while ((opt = getopt(argc, argv, "t:d:b:s:")) != -1) {
+		switch (opt) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'b':
+			bs = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (threads < 1 || duration < 1 || !bs || size < bs) {
+		usage(argv[0]);
+	}
+
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers) {
+		return 1;
+	}
+
+	start = now_ns();
+	for (i = 0; i < threads; i++) {
+		workers[i].id = i;
+		if (pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			return 1;
+		}
+	}
+
+	sleep(duration);
+	stop = 1;
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].err) {
+			fprintf(stderr, "worker %d: %s\n", i, strerror(-workers[i].err));
+			err = 1;
+		}
+		total += workers[i].nr;
+	}
+	elapsed = now_ns() - start;
+
+	if (err || !total) {
+		return 1;
+	}
+
+	all = malloc(total*sizeof(*all));
+	if (!all) {
+		return 1;
+	}
+
+	for (i = 0; i < threads; i++) {
+		memcpy(all + n, workers[i].lat, workers[i].nr*sizeof(*all));
+		n += workers[i].nr;
+	}
+	qsort(all, total, sizeof(*all), cmp_u64);
+
+	printf("%s: %d threads, %llu ops in %.2fs, %.0f ops/s, p50 %.1fus, p99 %.1fus\n",
+		argv[2], threads, (unsigned long long)total, elapsed/1e9,
+		total*1e9/elapsed, all[total/2]/1e3, all[total*99/100]/1e3);
+	printf("RESULT %s %.0f %llu %llu\n", argv[2], total*1e9/elapsed,
+		(unsigned long long)all[total/2], (unsigned long long)all[total*99/100]);
+
+	return 0;
+}
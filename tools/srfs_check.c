@@ -0,0 +1,713 @@
+/*
+ * Functional checks of the srfs ioctls for test.sh.
+ *
+ *   srfs_check <dir> clone|populate|extents
+ *
+ * clone:    clones a file and a directory tree with SRFS_IOC_CLONE, writes
+ *           to either side and checks the other one is unchanged and that
+ *           statfs free blocks only drop by the blocks copied on write.
+ * populate: creates nested directories and files with SRFS_IOC_POPULATE,
+ *           more files in one directory than an inode batch holds, then
+ *           checks a bad record and running out of space stop the call
+ *           with the right error and done count.
+ * extents:  checks SRFS_IOC_GET_EXTENTS and FIEMAP report a sequentially
+ *           written file as one extent and mark the blocks of a clone
+ *           shared. Needs a freshly mounted filesystem, where a new file
+ *           gets contiguous blocks.
+ *
+ * Every check works in its own subdirectory of dir and removes it again.
+ * The first mismatch is printed and the exit status is non-zero.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+/* The ioctl interface, as defined in ksrfs.h */
+#define SRFS_BLOCK_SIZE 1024
+
+#define SRFS_IOC_MAGIC 0xf2
+
+struct srfs_clone_args {
+	int64_t src_fd;
+	char name[NAME_MAX + 1];
+};
+
+#define SRFS_IOC_CLONE _IOW(SRFS_IOC_MAGIC, 1, struct srfs_clone_args)
+
+struct srfs_populate_args {
+	uint64_t buf;
+	uint64_t len;
+	uint64_t done;
+};
+
+struct srfs_populate_rec {
+	uint32_t mode;
+	uint32_t path_len;
+	uint64_t data_len;
+};
+
+#define SRFS_IOC_POPULATE _IOWR(SRFS_IOC_MAGIC, 2, struct srfs_populate_args)
+
+struct srfs_extent {
+	uint64_t logical;
+	uint64_t group;
+	uint64_t offset;
+	uint64_t length;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+#define SRFS_EXTENT_SHARED 0x0001
+#define SRFS_EXTENT_LAST 0x0002
+
+struct srfs_extents_args {
+	uint64_t start;
+	uint64_t extents;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+#define SRFS_IOC_GET_EXTENTS _IOWR(SRFS_IOC_MAGIC, 3, struct srfs_extents_args)
+
+#define SRFS_STORE_ADDR(grp_idx, off) (((uint64_t)(grp_idx) << 32) | (off))
+
+/* Inodes SRFS_IOC_POPULATE allocates at once */
+#define SRFS_INODE_BATCH 32
+
+static const char *dir;
+static const char *check;
+
+static int fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: ", check);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+
+	return -1;
+}
+
+static const char *path_of(const char *base, const char *name)
+{
+	static char path[PATH_MAX + 64];
+
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+	return path;
+}
+
+/*
+ * Content of a block, unique for every seed and block number so a dedup
+ * mount doesn't merge the blocks of the checks
+ */
+static void fill_block(char *buf, int seed, int blk)
+{
+	memset(buf, 'a' + seed % 26, SRFS_BLOCK_SIZE);
+	snprintf(buf, 32, "seed %d block %d", seed, blk);
+}
+
+static int put_block(const char *path, int blk, int seed)
+{
+	char buf[SRFS_BLOCK_SIZE];
+	int fd, ret = 0;
+
+	fd = open(path, O_CREAT | O_WRONLY, 0644);
+	if (fd < 0) {
+		return fail("open %s: %s", path, strerror(errno));
+	}
+
+	fill_block(buf, seed, blk);
+	if (pwrite(fd, buf, sizeof(buf), (off_t)blk*SRFS_BLOCK_SIZE) != sizeof(buf)) {
+		ret = fail("write block %d of %s: %s", blk, path, strerror(errno));
+	}
+	close(fd);
+
+	return ret;
+}
+
+static int put_blocks(const char *path, int nr, int seed)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (put_block(path, i, seed)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int expect_block(const char *path, int blk, int seed)
+{
+	char buf[SRFS_BLOCK_SIZE], want[SRFS_BLOCK_SIZE];
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return fail("open %s: %s", path, strerror(errno));
+	}
+
+	fill_block(want, seed, blk);
+	if (pread(fd, buf, sizeof(buf), (off_t)blk*SRFS_BLOCK_SIZE) != sizeof(buf)) {
+		ret = fail("read block %d of %s: %s", blk, path, strerror(errno));
+	} else if (memcmp(buf, want, sizeof(buf))) {
+		ret = fail("block %d of %s is \"%.31s\", expected \"%.31s\"", blk, path, buf, want);
+	}
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * The file holds size bytes of the blocks put_blocks would write with seed
+ */
+static int expect_file(const char *path, size_t size, int seed)
+{
+	char buf[SRFS_BLOCK_SIZE], want[SRFS_BLOCK_SIZE];
+	struct stat st;
+	size_t off, len;
+	int fd, ret = 0;
+
+	if (stat(path, &st)) {
+		return fail("stat %s: %s", path, strerror(errno));
+	}
+	if (!S_ISREG(st.st_mode) || (size_t)st.st_size != size) {
+		return fail("%s has mode %o and %lld bytes, expected a file of %zu",
+				path, st.st_mode, (long long)st.st_size, size);
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return fail("open %s: %s", path, strerror(errno));
+	}
+
+	for (off = 0; off < size && !ret; off += len) {
+		len = size - off < sizeof(buf) ? size - off : sizeof(buf);
+		fill_block(want, seed, off/SRFS_BLOCK_SIZE);
+		if (pread(fd, buf, len, off) != (ssize_t)len) {
+			ret = fail("read %s at %zu: %s", path, off, strerror(errno));
+		} else if (memcmp(buf, want, len)) {
+			ret = fail("%s differs in the block at %zu", path, off);
+		}
+	}
+	close(fd);
+
+	return ret;
+}
+
+static long free_blocks(void)
+{
+	struct statvfs st;
+
+	if (statvfs(dir, &st)) {
+		return fail("statfs %s: %s", dir, strerror(errno));
+	}
+
+	return st.f_bfree;
+}
+
+static int expect_free(long want, const char *what)
+{
+	long got = free_blocks();
+
+	if (got != want) {
+		return fail("%s: %ld free blocks, expected %ld", what, got, want);
+	}
+
+	return 0;
+}
+
+static int do_clone(const char *base, const char *src, const char *name)
+{
+	struct srfs_clone_args args;
+	int dfd, sfd, ret = 0;
+
+	dfd = open(base, O_RDONLY | O_DIRECTORY);
+	sfd = open(path_of(base, src), O_RDONLY);
+	if (dfd < 0 || sfd < 0) {
+		ret = fail("open %s or %s: %s", base, src, strerror(errno));
+		goto out;
+	}
+
+	memset(&args, 0, sizeof(args));
+	args.src_fd = sfd;
+	strncpy(args.name, name, NAME_MAX);
+	if (ioctl(dfd, SRFS_IOC_CLONE, &args)) {
+		ret = fail("clone %s to %s: %s", src, name, strerror(errno));
+	}
+
+out:
+	if (sfd >= 0) {
+		close(sfd);
+	}
+	if (dfd >= 0) {
+		close(dfd);
+	}
+	return ret;
+}
+
+static int check_clone(void)
+{
+	char base[PATH_MAX], src[PATH_MAX + 32], dst[PATH_MAX + 32];
+	long start, before;
+	int i;
+
+	start = free_blocks();
+	snprintf(base, sizeof(base), "%s/clone", dir);
+	if (start < 0 || mkdir(base, 0755)) {
+		return fail("mkdir %s: %s", base, strerror(errno));
+	}
+
+	/* A file clone shares all blocks, a write copies just the block written */
+	snprintf(src, sizeof(src), "%s/src", base);
+	snprintf(dst, sizeof(dst), "%s/dst", base);
+	if (put_blocks(src, 3, 1)) {
+		return -1;
+	}
+
+	before = free_blocks();
+	if (do_clone(base, "src", "dst") || expect_free(before, "file clone")) {
+		return -1;
+	}
+	for (i = 0; i < 3; i++) {
+		if (expect_block(dst, i, 1)) {
+			return -1;
+		}
+	}
+
+	if (put_block(dst, 1, 2) || expect_free(before - 1, "write to the clone") ||
+		expect_block(src, 1, 1) || expect_block(dst, 1, 2)) {
+		return -1;
+	}
+
+	if (put_block(src, 0, 3) || expect_free(before - 2, "write to the source") ||
+		expect_block(dst, 0, 1) || expect_block(src, 0, 3) ||
+		expect_block(src, 2, 1) || expect_block(dst, 2, 1)) {
+		return -1;
+	}
+
+	/* A tree clone only takes a block for each directory */
+	if (mkdir(path_of(base, "tree"), 0755) || mkdir(path_of(base, "tree/sub"), 0755)) {
+		return fail("mkdir tree: %s", strerror(errno));
+	}
+	if (put_blocks(path_of(base, "tree/a"), 1, 4) ||
+		put_blocks(path_of(base, "tree/sub/b"), 1, 5)) {
+		return -1;
+	}
+
+	before = free_blocks();
+	if (do_clone(base, "tree", "tree2") || expect_free(before - 2, "tree clone")) {
+		return -1;
+	}
+
+	if (expect_block(path_of(base, "tree2/a"), 0, 4) ||
+		put_block(path_of(base, "tree2/sub/b"), 0, 6) ||
+		expect_free(before - 3, "write to the tree clone") ||
+		expect_block(path_of(base, "tree/sub/b"), 0, 5) ||
+		expect_block(path_of(base, "tree2/sub/b"), 0, 6)) {
+		return -1;
+	}
+
+	if (put_block(path_of(base, "tree/a"), 0, 7) ||
+		expect_free(before - 4, "write to the source tree") ||
+		expect_block(path_of(base, "tree2/a"), 0, 4)) {
+		return -1;
+	}
+
+	/* Every shared block is given back once both sides are gone */
+	if (unlink(src) || unlink(dst) ||
+		unlink(path_of(base, "tree/a")) || unlink(path_of(base, "tree/sub/b")) ||
+		unlink(path_of(base, "tree2/a")) || unlink(path_of(base, "tree2/sub/b")) ||
+		rmdir(path_of(base, "tree/sub")) || rmdir(path_of(base, "tree2/sub")) ||
+		rmdir(path_of(base, "tree")) || rmdir(path_of(base, "tree2")) || rmdir(base)) {
+		return fail("remove %s: %s", base, strerror(errno));
+	}
+
+	return expect_free(start, "clones removed");
+}
+
+/*
+ * A populate buffer, records are appended by add_rec
+ */
+struct pop_buf {
+	char *buf;
+	size_t len;
+	size_t cap;
+};
+
+static struct srfs_populate_rec *add_rec(struct pop_buf *pb, mode_t mode,
+	const char *path, size_t data_len, int seed)
+{
+	struct srfs_populate_rec *rec;
+	size_t path_len = strlen(path);
+	size_t size, off;
+	char *buf;
+
+	/* header, path, data, padded to 8 bytes */
+	size = (sizeof(*rec) + path_len + data_len + 7) & ~(size_t)7;
+	if (pb->len + size > pb->cap) {
+		pb->cap = (pb->len + size)*2;
+		buf = realloc(pb->buf, pb->cap);
+		if (!buf) {
+			fail("out of memory");
+			exit(1);
+		}
+		pb->buf = buf;
+	}
+
+	rec = (struct srfs_populate_rec *)(pb->buf + pb->len);
+	memset(rec, 0, size);
+	rec->mode = mode;
+	rec->path_len = path_len;
+	rec->data_len = data_len;
+	buf = (char *)(rec + 1);
+	memcpy(buf, path, path_len);
+	buf += path_len;
+
+	for (off = 0; off < data_len; off += SRFS_BLOCK_SIZE) {
+		char block[SRFS_BLOCK_SIZE];
+
+		fill_block(block, seed, off/SRFS_BLOCK_SIZE);
+		memcpy(buf + off, block,
+			data_len - off < SRFS_BLOCK_SIZE ? data_len - off : SRFS_BLOCK_SIZE);
+	}
+
+	pb->len += size;
+	return rec;
+}
+
+/*
+ * Issue the buffer on base, returns the ioctl result with errno and the
+ * number of records done
+ */
+static int populate(const char *base, struct pop_buf *pb, uint64_t *done)
+{
+	struct srfs_populate_args args;
+	int dfd, ret, err;
+
+	dfd = open(base, O_RDONLY | O_DIRECTORY);
+	if (dfd < 0) {
+		return fail("open %s: %s", base, strerror(errno));
+	}
+
+	memset(&args, 0, sizeof(args));
+	args.buf = (uintptr_t)pb->buf;
+	args.len = pb->len;
+	args.done = ~0ULL;
+	ret = ioctl(dfd, SRFS_IOC_POPULATE, &args);
+	err = errno;
+	close(dfd);
+
+	*done = args.done;
+	pb->len = 0;
+	errno = err;
+	return ret;
+}
+
+static int count_entries(const char *path)
+{
+	struct dirent *de;
+	DIR *d;
+	int nr = 0;
+
+	d = opendir(path);
+	if (!d) {
+		return fail("opendir %s: %s", path, strerror(errno));
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+			nr++;
+		}
+	}
+	closedir(d);
+
+	return nr;
+}
+
+/* files of the populate check that run out of space, and their size limit */
+#define POP_FULL_FILES 6
+#define POP_FULL_MAX (64 << 20)
+
+static int check_populate(void)
+{
+	char base[PATH_MAX], name[64];
+	struct pop_buf pb = { NULL, 0, 0 };
+	struct srfs_populate_rec *rec;
+	uint64_t done;
+	long avail;
+	size_t per_file;
+	int i, nr, ret;
+
+	snprintf(base, sizeof(base), "%s/populate", dir);
+	if (mkdir(base, 0755)) {
+		return fail("mkdir %s: %s", base, strerror(errno));
+	}
+
+	/*
+	 * Nested directories, a walk back to a directory used before, odd
+	 * path and data lengths for the padding and more files in one
+	 * directory than an inode batch, which leaves a partly used batch
+	 */
+	add_rec(&pb, S_IFDIR | 0755, "d1", 0, 0);
+	add_rec(&pb, S_IFDIR | 0755, "d1/d2", 0, 0);
+	add_rec(&pb, S_IFREG | 0644, "d1/d2/f1", 1500, 10);
+	add_rec(&pb, 0644, "d1/f2", 0, 0);
+	add_rec(&pb, S_IFREG | 0644, "f3", 100, 11);
+	add_rec(&pb, S_IFREG | 0644, "d1/d2/f4", SRFS_BLOCK_SIZE, 12);
+	add_rec(&pb, S_IFDIR | 0755, "d1/many", 0, 0);
+	nr = 7;
+	for (i = 0; i < SRFS_INODE_BATCH + 4; i++) {
+		snprintf(name, sizeof(name), "d1/many/e%02d", i);
+		add_rec(&pb, S_IFREG | 0644, name, 0, 0);
+		nr++;
+	}
+
+	ret = populate(base, &pb, &done);
+	if (ret || done != (uint64_t)nr) {
+		return fail("populate returned %d (%s), %llu of %d records done",
+				ret, ret ? strerror(errno) : "ok", (unsigned long long)done, nr);
+	}
+
+	if (expect_file(path_of(base, "d1/d2/f1"), 1500, 10) ||
+		expect_file(path_of(base, "d1/f2"), 0, 0) ||
+		expect_file(path_of(base, "f3"), 100, 11) ||
+		expect_file(path_of(base, "d1/d2/f4"), SRFS_BLOCK_SIZE, 12)) {
+		return -1;
+	}
+	if (count_entries(path_of(base, "d1/many")) != SRFS_INODE_BATCH + 4) {
+		return fail("d1/many doesn't hold %d entries", SRFS_INODE_BATCH + 4);
+	}
+
+	/* A path longer than the buffer stops the call after the good record */
+	add_rec(&pb, S_IFREG | 0644, "ok", 10, 13);
+	rec = add_rec(&pb, S_IFREG | 0644, "bad", 0, 0);
+	rec->path_len = 1 << 20;
+	ret = populate(base, &pb, &done);
+	if (ret != -1 || errno != EINVAL || done != 1) {
+		return fail("oversized path_len: returned %d (%s), %llu records done",
+				ret, ret ? strerror(errno) : "ok", (unsigned long long)done);
+	}
+	if (expect_file(path_of(base, "ok"), 10, 13)) {
+		return -1;
+	}
+
+	/*
+	 * Running out of blocks part way, done counts the files completely
+	 * written and nothing after the failing record is created
+	 */
+	avail = free_blocks();
+	if (avail < 0) {
+		return -1;
+	}
+
+	/* The data is in the buffer, don't try to fill a large mount */
+	per_file = (avail/4 + 1)*SRFS_BLOCK_SIZE;
+	if (per_file*POP_FULL_FILES > POP_FULL_MAX) {
+		printf("%s: %ld free blocks, out of space case skipped\n", check, avail);
+		goto cleanup;
+	}
+
+	for (i = 0; i < POP_FULL_FILES; i++) {
+		snprintf(name, sizeof(name), "full%d", i);
+		add_rec(&pb, S_IFREG | 0644, name, per_file, 20 + i);
+	}
+
+	ret = populate(base, &pb, &done);
+	if (ret != -1 || errno != ENOSPC || done == 0 || done >= POP_FULL_FILES) {
+		return fail("out of space: returned %d (%s), %llu of %d records done",
+				ret, ret ? strerror(errno) : "ok", (unsigned long long)done,
+				POP_FULL_FILES);
+	}
+	for (i = 0; i < POP_FULL_FILES; i++) {
+		snprintf(name, sizeof(name), "full%d", i);
+		if ((uint64_t)i < done) {
+			if (expect_file(path_of(base, name), per_file, 20 + i)) {
+				return -1;
+			}
+		} else if ((uint64_t)i > done && access(path_of(base, name), F_OK) == 0) {
+			return fail("%s created after the failing record", name);
+		}
+	}
+
+cleanup:
+	free(pb.buf);
+
+	for (i = 0; i < SRFS_INODE_BATCH + 4; i++) {
+		snprintf(name, sizeof(name), "d1/many/e%02d", i);
+		unlink(path_of(base, name));
+	}
+	for (i = 0; i < POP_FULL_FILES; i++) {
+		snprintf(name, sizeof(name), "full%d", i);
+		unlink(path_of(base, name));
+	}
+	if (rmdir(path_of(base, "d1/many")) || unlink(path_of(base, "d1/d2/f1")) ||
+		unlink(path_of(base, "d1/d2/f4")) || rmdir(path_of(base, "d1/d2")) ||
+		unlink(path_of(base, "d1/f2")) || rmdir(path_of(base, "d1")) ||
+		unlink(path_of(base, "f3")) || unlink(path_of(base, "ok")) || rmdir(base)) {
+		return fail("remove %s: %s", base, strerror(errno));
+	}
+
+	return 0;
+}
+
+/* most extents a file of the extents check is expected to have */
+#define EXT_MAX 8
+
+/*
+ * Compare the extents SRFS_IOC_GET_EXTENTS and FIEMAP report for the file
+ * with nr extents of the given lengths (in blocks) and shared flags
+ */
+static int expect_extents(const char *path, int nr, const int *blocks, const int *shared)
+{
+	struct srfs_extent ext[EXT_MAX];
+	struct srfs_extents_args args;
+	struct {
+		struct fiemap fm;
+		struct fiemap_extent fe[EXT_MAX];
+	} fm;
+	uint64_t logical = 0, len, flags;
+	int fd, i, ret = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return fail("open %s: %s", path, strerror(errno));
+	}
+
+	memset(&args, 0, sizeof(args));
+	args.extents = (uintptr_t)ext;
+	args.count = EXT_MAX;
+	memset(&fm, 0, sizeof(fm));
+	fm.fm.fm_length = FIEMAP_MAX_OFFSET;
+	fm.fm.fm_extent_count = EXT_MAX;
+	if (ioctl(fd, SRFS_IOC_GET_EXTENTS, &args) || ioctl(fd, FS_IOC_FIEMAP, &fm)) {
+		ret = fail("extents of %s: %s", path, strerror(errno));
+		goto out;
+	}
+
+	if (args.count != (uint32_t)nr || fm.fm.fm_mapped_extents != (uint32_t)nr) {
+		ret = fail("%s has %u extents, %u by FIEMAP, expected %d",
+				path, args.count, fm.fm.fm_mapped_extents, nr);
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		len = (uint64_t)blocks[i]*SRFS_BLOCK_SIZE;
+		flags = (shared[i] ? SRFS_EXTENT_SHARED : 0) | (i == nr - 1 ? SRFS_EXTENT_LAST : 0);
+		if (ext[i].logical != logical || ext[i].length != len || ext[i].flags != flags) {
+			ret = fail("%s extent %d: %llu+%llu flags %x, expected %llu+%llu flags %llx",
+					path, i, (unsigned long long)ext[i].logical,
+					(unsigned long long)ext[i].length, ext[i].flags,
+					(unsigned long long)logical, (unsigned long long)len,
+					(unsigned long long)flags);
+			goto out;
+		}
+
+		flags = (shared[i] ? FIEMAP_EXTENT_SHARED : 0) | (i == nr - 1 ? FIEMAP_EXTENT_LAST : 0);
+		if (fm.fe[i].fe_logical != logical || fm.fe[i].fe_length != len ||
+			fm.fe[i].fe_flags != flags ||
+			fm.fe[i].fe_physical != SRFS_STORE_ADDR(ext[i].group, ext[i].offset)) {
+			ret = fail("%s FIEMAP extent %d: %llu+%llu at %llx flags %x, expected %llu+%llu at %llx flags %llx",
+					path, i, (unsigned long long)fm.fe[i].fe_logical,
+					(unsigned long long)fm.fe[i].fe_length,
+					(unsigned long long)fm.fe[i].fe_physical, fm.fe[i].fe_flags,
+					(unsigned long long)logical, (unsigned long long)len,
+					(unsigned long long)SRFS_STORE_ADDR(ext[i].group, ext[i].offset),
+					(unsigned long long)flags);
+			goto out;
+		}
+
+		logical += len;
+	}
+
+out:
+	close(fd);
+	return ret;
+}
+
+static int check_extents(void)
+{
+	static const int whole[] = { 4 }, split[] = { 1, 1, 2 };
+	static const int exclusive[] = { 0 }, shared[] = { 1 }, cowed[] = { 1, 0, 1 };
+	char base[PATH_MAX], seq[PATH_MAX + 32], copy[PATH_MAX + 32];
+
+	snprintf(base, sizeof(base), "%s/extents", dir);
+	snprintf(seq, sizeof(seq), "%s/seq", base);
+	snprintf(copy, sizeof(copy), "%s/copy", base);
+	if (mkdir(base, 0755)) {
+		return fail("mkdir %s: %s", base, strerror(errno));
+	}
+
+	/* Written front to back, each block follows the previous one */
+	if (put_blocks(seq, 4, 30) || expect_extents(seq, 1, whole, exclusive)) {
+		return -1;
+	}
+
+	/* Both sides of a clone reference the same blocks */
+	if (do_clone(base, "seq", "copy") ||
+		expect_extents(seq, 1, whole, shared) || expect_extents(copy, 1, whole, shared)) {
+		return -1;
+	}
+
+	/* The block written is copied and splits the extent on both sides */
+	if (put_block(copy, 1, 31) ||
+		expect_extents(copy, 3, split, cowed) || expect_extents(seq, 3, split, cowed)) {
+		return -1;
+	}
+
+	if (unlink(seq) || unlink(copy) || rmdir(base)) {
+		return fail("remove %s: %s", base, strerror(errno));
+	}
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s <dir> clone|populate|extents\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	if (argc != 3) {
+		usage(argv[0]);
+	}
+
+	dir = argv[1];
+	check = argv[2];
+	if (!strcmp(check, "clone")) {
+		ret = check_clone();
+	} else if (!strcmp(check, "populate")) {
+		ret = check_populate();
+	} else if (!strcmp(check, "extents")) {
+		ret = check_extents();
+	} else {
+		usage(argv[0]);
+	}
+
+	if (ret) {
+		return 1;
+	}
+
+	printf("%s: ok\n", check);
+	return 0;
+}
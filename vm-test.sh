@@ -0,0 +1,41 @@
+#!/bin/bash
+#
+# Run test.sh inside a throwaway VM booted from a locally built kernel, so a
+# crashing module doesn't take the host down and results don't depend on the
+# host kernel. Needs virtme (virtme-run) or virtme-ng (vng) and QEMU; the VM
+# shares the host's root filesystem read only and this directory read write.
+#
+#   KDIR=~/linux ./vm-test.sh [VAR=value ...]
+#
+# KDIR is a configured and built kernel tree, extra arguments are passed to
+# test.sh as environment, e.g. WRITERS=8 MOUNT_OPTS=dedup. DRY_RUN=1 skips
+# the build and prints the VM command line instead of running it.
+
+MODULE_SRC=$(cd "$(dirname "$0")" && pwd)
+KDIR=${KDIR:?set KDIR to a built kernel tree}
+MEMORY=${MEMORY:-2G}
+CPUS=${CPUS:-4}
+
+cd $MODULE_SRC || exit 1
+
+# build against the VM kernel on the host, the guest only loads and runs
+if [ -z "$DRY_RUN" ]; then
+	make KDIR=$KDIR clean || exit 2
+	make KDIR=$KDIR || exit 2
+	cc -O2 -o tools/srfs_check tools/srfs_check.c || exit 2
+	cc -O2 -pthread -o tools/srfs_bench tools/srfs_bench.c || exit 2
+fi
+
+cmd="cd $MODULE_SRC && env SKIP_BUILD=1 MOUNT_POINT=/tmp/srfs $* ./test.sh"
+
+if command -v vng > /dev/null; then
+	exec ${DRY_RUN:+echo} vng --run $KDIR --rwdir $MODULE_SRC --memory $MEMORY \
+		--cpus $CPUS --exec "$cmd"
+elif command -v virtme-run > /dev/null; then
+	# --qemu-opts takes every argument after it, so it has to come last
+	exec ${DRY_RUN:+echo} virtme-run --kdir $KDIR --rwdir $MODULE_SRC --memory $MEMORY \
+		--script-sh "$cmd" --qemu-opts -smp $CPUS
+fi
+
+echo "neither vng (virtme-ng) nor virtme-run found"
+exit 1